@@ -1,574 +1,2670 @@
 #include "customAllocator.h"
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <iostream>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 using namespace std;
 
+static_assert(CUSTOM_ALIGNMENT == 8 || CUSTOM_ALIGNMENT == 16,
+              "CUSTOM_ALIGNMENT must be 8 or 16");
+
 static void *initial_break = nullptr;
 
 Block *block_list = nullptr;
-
-Block *allocateBlock(size_t aligned_size, Block *last = nullptr);
-Block *find_best_fit(size_t size, Block *current = block_list);
+static Block *st_fence = nullptr; // fence header at the end of the heap
+static FreeBins st_bins;
+static SlabHeap st_slabs;
+static bool st_slabs_ready = false;
+static bool st_deferred = false; // see heapCreateEx
+static atomic<size_t> mmap_threshold(DEFAULT_MMAP_THRESHOLD);
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+// break memory at or above st_zero_from reads as zero: the break never got
+// there, or its pages went back when the break was lowered. the rest of the
+// page a lowered break ends in keeps its bytes.
+static char *st_zero_from = nullptr;
+// the block allocateBlock made last and how many bytes at the start of its
+// payload may not be zero, for customCalloc
+static Block *st_fresh_block = nullptr;
+static size_t st_fresh_dirty = 0;
+
+// counters for the statistics, everything else is found by walking the heaps
+static unsigned long st_sbrk_calls = 0;
+static atomic<size_t> large_blocks(0);
+static atomic<size_t> large_bytes(0);
+static atomic<unsigned long> mmap_calls(0);
+
+Block *allocateBlock(size_t aligned_size);
 void splitBlock(Block *block, size_t size_offset);
-void tryCoalesce(Block *&block);
+void tryCoalesce(Block *&block, FreeBins *bins);
 bool is_pointer_in_heap(void *ptr);
 void shrinking_block_split(Block *block, size_t new_size);
+void releaseBlock(Block *block);
+bool is_large_request(size_t aligned_size);
+Block *mmapBlock(size_t aligned_size);
+static Block *mmapAlignedBlock(size_t aligned_size, size_t alignment);
+static void slabHeapDestroy(SlabHeap *heap);
+static size_t pageSize();
+static void quickFlush(FreeBins *bins, void (*release)(Block *));
+static void profileDropHeap(bool mt);
 
 // Helper functions for multi thread memory allocator
-void heapCreate() { 
+void heapCreate() {
   if (initial_break == nullptr) initial_break = sbrk(0);
 }
 
+void heapCreateEx(const HeapConfig *config) {
+  heapCreate();
+  bool deferred = config != nullptr && config->deferred_coalescing;
+  if (!deferred)
+    quickFlush(&st_bins, releaseBlock); // nothing may stay parked
+  st_deferred = deferred;
+}
+
 void heapKill() {
+  profileDropHeap(false);
   if (initial_break != nullptr) {
     brk(initial_break);
     initial_break = nullptr;
   }
   block_list = nullptr;
+  st_fence = nullptr;
+  st_zero_from = nullptr;
+  st_fresh_block = nullptr;
+  memset(&st_bins, 0, sizeof(st_bins));
+  st_deferred = false;
+  if (st_slabs_ready) {
+    slabHeapDestroy(&st_slabs);
+    st_slabs_ready = false;
+  }
 }
 
-void *customMalloc(size_t size) {
+// magic word tied to the header address, so a stale or copied header does
+// not validate
+unsigned int blockMagic(Block *block) {
+  return BLOCK_MAGIC ^ (unsigned int)((size_t)block >> 2);
+}
 
-  if (size == 0)
-    return nullptr;
+// no object may be bigger than PTRDIFF_MAX. bigger requests fail, rounding
+// them or adding a header and padding could wrap around.
+static bool tooLarge(size_t size) { return size > (size_t)PTRDIFF_MAX; }
+
+// round up to the allocator granularity, never below what a free block needs.
+// headers start at multiples of CUSTOM_ALIGNMENT and are that long, so
+// rounding every size keeps every payload aligned.
+// callers reject sizes tooLarge() first, nothing below that wraps around.
+static size_t alignedBlockSize(size_t size) {
+  if (size < MIN_BLOCK_SIZE)
+    size = MIN_BLOCK_SIZE;
+  return ALIGN_UP(size, CUSTOM_ALIGNMENT);
+}
 
-  size_t aligned_size = ALIGN_TO_MULT_OF_4(size);
+/*=============================================================================
+* block header helpers
+=============================================================================*/
+static size_t blockSize(Block *block) {
+  return block->size & ~(size_t)BLOCK_FLAGS;
+}
 
-  if (block_list == nullptr) { // first allocation
+static bool isFree(Block *block) { return block->size & BLOCK_FREE; }
 
-    heapCreate();
-    block_list = allocateBlock(aligned_size);
-    if (block_list == nullptr)
-      return nullptr;
+static bool isMmapped(Block *block) { return block->size & BLOCK_MMAPPED; }
 
-    return (void *)((char *)block_list + sizeof(Block));
-  }
+// changes the payload size, keeping the flags
+static void setBlockSize(Block *block, size_t size) {
+  block->size = size | (block->size & BLOCK_FLAGS);
+}
+
+static void *payloadOf(Block *block) {
+  return (void *)((char *)block + sizeof(Block));
+}
 
-  Block *best_fit = find_best_fit(aligned_size);
+static Block *headerOf(void *ptr) {
+  return (Block *)((char *)ptr - sizeof(Block));
+}
 
-  // found a free block
-  if (best_fit != nullptr) {
+static Block *nextBlock(Block *block) {
+  return (Block *)((char *)block + sizeof(Block) + blockSize(block));
+}
 
-    // check if block can be split
-    if (best_fit->size >= aligned_size + sizeof(Block) + 4) {
-      splitBlock(best_fit, aligned_size);
-    }
+// only valid while the block carries BLOCK_PREV_FREE
+static Block *prevFreeBlock(Block *block) {
+  size_t prev_size = *((size_t *)block - 1);
+  return (Block *)((char *)block - prev_size - sizeof(Block));
+}
 
-    best_fit->is_free = false;
+// free blocks get a footer and announce themselves to the next block
+static void markFree(Block *block) {
+  Block *next = nextBlock(block);
+  block->size |= BLOCK_FREE;
+  *((size_t *)next - 1) = blockSize(block);
+  next->size |= BLOCK_PREV_FREE;
+}
 
-    // return a pointer to memory after the block metadata
-    return (void *)((char *)best_fit + sizeof(Block));
-  } else { // didn't find a free block, extend heap
-    Block *last = block_list;
-    while (last->next != nullptr) {
-      last = last->next;
+static void markUsed(Block *block) {
+  block->size &= ~(size_t)BLOCK_FREE;
+  nextBlock(block)->size &= ~(size_t)BLOCK_PREV_FREE;
+}
+
+// header of size 0 that ends every heap and area
+static void writeFence(Block *fence, unsigned int area_id) {
+  fence->size = 0;
+  fence->magic = 0;
+  fence->area_id = area_id;
+}
+/*=============================================================================
+* size class free lists
+=============================================================================*/
+#define SMALL_CLASS_SHIFT 9 // log2(SMALL_CLASS_LIMIT)
+#define MAX_CLASS_SCAN 32   // candidates inspected in a larger class
+
+size_t sizeClass(size_t size) {
+  if (size < SMALL_CLASS_LIMIT)
+    return size >> 4;
+
+  int msb = 63 - __builtin_clzll(size);
+  size_t sub = (size >> (msb - 2)) & (CLASS_SUBDIVISIONS - 1);
+  size_t cls = (SMALL_CLASS_LIMIT >> 4) +
+               (msb - SMALL_CLASS_SHIFT) * CLASS_SUBDIVISIONS + sub;
+  return cls < NUM_SIZE_CLASSES ? cls : NUM_SIZE_CLASSES - 1;
+}
+
+static FreeLinks *linksOf(Block *block) {
+  return (FreeLinks *)payloadOf(block);
+}
+
+void binInsert(FreeBins *bins, Block *block) {
+  size_t cls = sizeClass(blockSize(block));
+  FreeLinks *links = linksOf(block);
+
+  links->prev_free = nullptr;
+  links->next_free = bins->heads[cls];
+  if (bins->heads[cls] != nullptr) {
+    linksOf(bins->heads[cls])->prev_free = block;
+  }
+  bins->heads[cls] = block;
+  bins->nonempty[cls / 64] |= 1ULL << (cls % 64);
+}
+
+void binRemove(FreeBins *bins, Block *block) {
+  size_t cls = sizeClass(blockSize(block));
+  FreeLinks *links = linksOf(block);
+
+  if (links->prev_free != nullptr) {
+    linksOf(links->prev_free)->next_free = links->next_free;
+  } else {
+    bins->heads[cls] = links->next_free;
+    if (bins->heads[cls] == nullptr) {
+      bins->nonempty[cls / 64] &= ~(1ULL << (cls % 64));
     }
+  }
+  if (links->next_free != nullptr) {
+    linksOf(links->next_free)->prev_free = links->prev_free;
+  }
+}
 
-    Block *new_block = allocateBlock(aligned_size, last);
-    if (new_block == nullptr)
-      return nullptr;
-    // return pointer to memory allocated for user
-    return (void *)((char *)new_block + sizeof(Block));
+// first non empty class strictly above cls, NUM_SIZE_CLASSES if none
+static size_t nextNonemptyClass(FreeBins *bins, size_t cls) {
+  size_t start = cls + 1;
+  for (size_t word = start / 64; word < CLASS_BITMAP_WORDS; word++) {
+    unsigned long long bits = bins->nonempty[word];
+    if (word == start / 64) {
+      bits &= ~0ULL << (start % 64);
+    }
+    if (bits != 0) {
+      return word * 64 + __builtin_ctzll(bits);
+    }
   }
+  return NUM_SIZE_CLASSES;
 }
 
-Block *find_best_fit(size_t size, Block *current) {
+// best fit over the size class lists. the request's own class is scanned for
+// the tightest fit, every block in a higher class fits so only the first
+// non empty one is looked at.
+Block *findBestFit(FreeBins *bins, size_t size) {
+  size_t cls = sizeClass(size);
   Block *best_fit = nullptr;
 
-  while (current != nullptr) {
+  for (Block *current = bins->heads[cls]; current != nullptr;
+       current = linksOf(current)->next_free) {
     // fits perfect
-    if (current->is_free && current->size == size) {
+    if (blockSize(current) == size) {
+      return current;
+    }
+    if (blockSize(current) > size &&
+        (best_fit == nullptr || blockSize(current) < blockSize(best_fit))) {
       best_fit = current;
-      break;
     }
+  }
+  if (best_fit != nullptr)
+    return best_fit;
 
-    if (current->is_free && current->size >= size) {
-      // free block found
-      if (best_fit == nullptr || current->size < best_fit->size) {
-        best_fit = current;
-      }
+  cls = nextNonemptyClass(bins, cls);
+  if (cls == NUM_SIZE_CLASSES)
+    return nullptr;
+
+  int scanned = 0;
+  for (Block *current = bins->heads[cls];
+       current != nullptr && scanned < MAX_CLASS_SCAN;
+       current = linksOf(current)->next_free, scanned++) {
+    if (best_fit == nullptr || blockSize(current) < blockSize(best_fit)) {
+      best_fit = current;
     }
-    current = current->next;
   }
-
   return best_fit;
 }
 
-void splitBlock(Block *block, size_t size_offset) {
+/*=============================================================================
+* quick lists
+=============================================================================*/
+// in deferred coalescing mode a freed block is parked, unmerged and still
+// marked in use, on the quick list of its exact 16 byte class. a request of
+// that class reuses it without any merging or splitting. the lists are
+// merged into the free lists as a batch when a request finds no free block,
+// or when QUICK_MAX_BLOCKS are parked. parked headers carry no magic, so
+// freeing a parked block again is caught like any invalid pointer.
+
+// returns false if the block is too big to be parked
+static bool quickPush(FreeBins *bins, Block *block) {
+  size_t cls = blockSize(block) >> 4;
+  if (cls >= QUICK_NUM_CLASSES)
+    return false;
+
+  block->magic = 0;
+  linksOf(block)->next_free = bins->quick[cls];
+  bins->quick[cls] = block;
+  bins->quick_count++;
+  return true;
+}
 
-  Block *remainder = (Block *)((char *)block + sizeof(Block) + size_offset);
+// a parked block of at least aligned_size bytes from the request's class
+static Block *quickPop(FreeBins *bins, size_t aligned_size) {
+  size_t cls = (aligned_size + 15) >> 4;
+  if (cls >= QUICK_NUM_CLASSES || bins->quick[cls] == nullptr)
+    return nullptr;
 
-  remainder->size = block->size - size_offset - sizeof(Block);
-  remainder->is_free = true;
-  remainder->next = block->next;
-  remainder->prev = block;
+  Block *block = bins->quick[cls];
+  bins->quick[cls] = linksOf(block)->next_free;
+  bins->quick_count--;
+  block->magic = blockMagic(block);
+  return block;
+}
 
-  if (block->next != nullptr) {
-    block->next->prev = remainder;
+// merges every parked block through release
+static void quickFlush(FreeBins *bins, void (*release)(Block *)) {
+  for (size_t cls = 0; cls < QUICK_NUM_CLASSES; cls++) {
+    while (bins->quick[cls] != nullptr) {
+      Block *block = bins->quick[cls];
+      bins->quick[cls] = linksOf(block)->next_free;
+      block->magic = blockMagic(block);
+      release(block);
+    }
   }
-  block->size = size_offset;
-  block->next = remainder;
+  bins->quick_count = 0;
 }
 
-Block *allocateBlock(size_t aligned_size, Block *last) {
-
-  // allocate space for block metadata + requested size
-  size_t total_size = sizeof(Block) + aligned_size;
-
-  void *result = sbrk(total_size);
-
-  // errors
-  if (result == SBRK_FAIL) {
-    if (errno == ENOMEM) {
-      heapKill();
-      cerr << "<sbrk/brk error>: out of memory" << endl;
-      exit(1);
-    }
-    return nullptr; // other sbrk error
+/*=============================================================================
+* slabs
+=============================================================================*/
+// objects of up to SLAB_MAX_SIZE bytes have no header. they live in page
+// sized slabs of one object size, carved from a range reserved up front, so a
+// pointer is recognised by a range check and its slab is found by rounding it
+// down to the page. each slab tracks its free objects in a bitmap.
+static void slabHeapInit(SlabHeap *heap, bool thread_safe) {
+  memset(heap, 0, sizeof(*heap));
+  heap->thread_safe = thread_safe;
+  pthread_mutex_init(&heap->pool_lock, nullptr);
+  for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+    pthread_mutex_init(&heap->class_locks[i], nullptr);
   }
 
-  // Create a new block
-  Block *new_block = (Block *)result;
+  // address space only, pages are committed as slabs get used
+  void *region = mmap(nullptr, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED)
+    return; // no slabs, small requests take the block path
 
-  // metadata
-  new_block->size = aligned_size;
-  new_block->is_free = false;
-  new_block->next = nullptr;
-  new_block->prev = last;
+  heap->base = (char *)region;
+  heap->unused = heap->base;
+  heap->end = heap->base + SLAB_REGION_SIZE;
+}
 
-  if (last != nullptr) {
-    last->next = new_block;
+static void slabHeapDestroy(SlabHeap *heap) {
+  if (heap->base != nullptr) {
+    munmap(heap->base, SLAB_REGION_SIZE);
   }
-
-  return new_block;
+  pthread_mutex_destroy(&heap->pool_lock);
+  for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+    pthread_mutex_destroy(&heap->class_locks[i]);
+  }
+  memset(heap, 0, sizeof(*heap));
 }
 
-void tryCoalesce(Block *&block) {
-
-  // previous block
-  if (block->prev != nullptr && block->prev->is_free) {
+// the whole reserved range counts, its bounds never change while unused
+// moves under the pool lock. slabs past unused read as zeros and fail the
+// magic check like any other pointer that is not an object.
+static bool isSlabPointer(SlabHeap *heap, void *ptr) {
+  return (char *)ptr >= heap->base && (char *)ptr < heap->end;
+}
 
-    Block *block_to_coalesce = block->prev;
+static Slab *slabOf(void *ptr) {
+  return (Slab *)((size_t)ptr & ~(size_t)(SLAB_SIZE - 1));
+}
 
-    // adjust new size
-    size_t new_size = block_to_coalesce->size + block->size + sizeof(Block);
-    block_to_coalesce->size = new_size;
+static size_t slabObjectSize(void *ptr) { return slabOf(ptr)->object_size; }
 
-    // adjust links
-    block_to_coalesce->next = block->next;
-    if (block->next != nullptr) { // if next is null no need to change pointers
-      block->next->prev = block_to_coalesce;
-    }
+static void slabLock(SlabHeap *heap, pthread_mutex_t *lock) {
+  if (heap->thread_safe)
+    pthread_mutex_lock(lock);
+}
 
-    block = block_to_coalesce; // block pointer to previous block
-  }
+static void slabUnlock(SlabHeap *heap, pthread_mutex_t *lock) {
+  if (heap->thread_safe)
+    pthread_mutex_unlock(lock);
+}
 
-  // next block
-  if (block->next != nullptr && block->next->is_free) {
+static void slabListPush(Slab *&head, Slab *slab) {
+  slab->prev = nullptr;
+  slab->next = head;
+  if (head != nullptr)
+    head->prev = slab;
+  head = slab;
+}
 
-    Block *block_to_coalesce = block->next;
+static void slabListRemove(Slab *&head, Slab *slab) {
+  if (slab->prev != nullptr)
+    slab->prev->next = slab->next;
+  else
+    head = slab->next;
+  if (slab->next != nullptr)
+    slab->next->prev = slab->prev;
+}
 
-    // adjust new size
-    size_t new_size = block_to_coalesce->size + block->size + sizeof(Block);
-    block->size = new_size;
+// a fresh or recycled slab formatted for objects of class cls
+static Slab *slabCreate(SlabHeap *heap, size_t cls) {
+  slabLock(heap, &heap->pool_lock);
+  Slab *slab = heap->empty;
+  if (slab != nullptr) {
+    slabListRemove(heap->empty, slab);
+  } else if (heap->unused < heap->end) {
+    slab = (Slab *)heap->unused;
+    heap->unused += SLAB_SIZE;
+  }
+  slabUnlock(heap, &heap->pool_lock);
+  if (slab == nullptr)
+    return nullptr;
 
-    // adjust links
-    block->next = block_to_coalesce->next;
-    if (block_to_coalesce->next !=
-        nullptr) { // if next is null no need to change pointers
-      block_to_coalesce->next->prev = block;
-    }
+  slab->magic = SLAB_MAGIC;
+  slab->object_size = (cls + 1) * 16;
+  slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->object_size;
+  slab->free_count = slab->capacity;
+  memset(slab->free_bits, 0, sizeof(slab->free_bits));
+  for (unsigned int i = 0; i < slab->capacity; i++) {
+    slab->free_bits[i / 64] |= 1ULL << (i % 64);
   }
+  return slab;
 }
 
-bool is_pointer_in_heap(void *ptr) {
-  Block *iterator = block_list;
-  bool found = false;
-  while (iterator != nullptr) {
-    if ((char *)iterator + sizeof(Block) == (char *)ptr) {
-      found = true;
-      break;
+// takes up to count objects of class cls (object size (cls + 1) * 16) under
+// one hold of the class lock
+static size_t slabAllocBatch(SlabHeap *heap, size_t cls, void **out,
+                             size_t count) {
+  if (heap->base == nullptr)
+    return 0;
+
+  size_t taken = 0;
+  slabLock(heap, &heap->class_locks[cls]);
+
+  while (taken < count) {
+    Slab *slab = heap->partial[cls];
+    if (slab == nullptr) {
+      slab = slabCreate(heap, cls);
+      if (slab == nullptr)
+        break; // reserved range used up
+      slabListPush(heap->partial[cls], slab);
+    }
+
+    for (int word = 0; word < SLAB_BITMAP_WORDS && taken < count; word++) {
+      while (slab->free_bits[word] != 0 && taken < count) {
+        int bit = __builtin_ctzll(slab->free_bits[word]);
+        slab->free_bits[word] &= ~(1ULL << bit);
+        slab->free_count--;
+        out[taken++] = (char *)slab + SLAB_HEADER_SIZE +
+                       (size_t)(word * 64 + bit) * slab->object_size;
+      }
     }
-    iterator = iterator->next;
+
+    // full slabs leave the partial list until an object comes back
+    if (slab->free_count == 0)
+      slabListRemove(heap->partial[cls], slab);
   }
 
-  return found;
+  slabUnlock(heap, &heap->class_locks[cls]);
+  return taken;
 }
 
-void customFree(void *ptr) {
+static void *slabAlloc(SlabHeap *heap, size_t cls) {
+  void *ptr = nullptr;
+  slabAllocBatch(heap, cls, &ptr, 1);
+  return ptr;
+}
 
-  // check if null
-  if (ptr == nullptr) {
-    string message = "<free error>: passed null pointer";
-    cerr << message << endl;
-    return;
-  }
+// index of the object ptr points at, -1 if it is not the start of one
+static long slabIndexOf(Slab *slab, void *ptr) {
+  char *objects = (char *)slab + SLAB_HEADER_SIZE;
+  if (slab->magic != SLAB_MAGIC || (char *)ptr < objects)
+    return -1;
+
+  size_t offset = (char *)ptr - objects;
+  if (offset % slab->object_size != 0 ||
+      offset / slab->object_size >= slab->capacity)
+    return -1;
+  return offset / slab->object_size;
+}
 
-  // check if pointer is valid
-  if (!is_pointer_in_heap(ptr)) {
-    string message = "<free error>: passed non-heap pointer";
-    cerr << message << endl;
-    return;
-  }
+// true if ptr is an allocated object. objects parked in a thread cache are
+// allocated as far as their slab knows.
+static bool slabIsLive(SlabHeap *heap, void *ptr) {
+  Slab *slab = slabOf(ptr);
+  long index = slabIndexOf(slab, ptr);
+  if (index < 0)
+    return false;
+
+  size_t cls = slab->object_size / 16 - 1;
+  slabLock(heap, &heap->class_locks[cls]);
+  bool live = !(slab->free_bits[index / 64] & (1ULL << (index % 64)));
+  slabUnlock(heap, &heap->class_locks[cls]);
+  return live;
+}
 
-  Block *block = (Block *)((char *)ptr - sizeof(Block));
-  block->is_free = true;
+// returns false if ptr is not a live object of the heap's slabs
+static bool slabFree(SlabHeap *heap, void *ptr) {
+  Slab *slab = slabOf(ptr);
+  long index = slabIndexOf(slab, ptr);
+  if (index < 0)
+    return false;
 
-  tryCoalesce(block);
+  size_t cls = slab->object_size / 16 - 1;
+  unsigned long long bit = 1ULL << (index % 64);
 
-  // if next block is null, we can release memory back to OS
-  if (block->next == nullptr) {
+  slabLock(heap, &heap->class_locks[cls]);
+  if (slab->free_bits[index / 64] & bit) {
+    slabUnlock(heap, &heap->class_locks[cls]);
+    return false; // not an object, or freed already
+  }
 
-    // adjust links
-    if (block->prev != nullptr) {
-      block->prev->next = nullptr;
-    } else {
-      block_list = nullptr;
-    }
+  slab->free_bits[index / 64] |= bit;
+  slab->free_count++;
 
-    size_t size_to_release = sizeof(Block) + block->size;
-    sbrk(-size_to_release); // release memory back to OS
+  if (slab->free_count == 1) {
+    slabListPush(heap->partial[cls], slab); // was full
   }
-}
 
-void *customCalloc(size_t nmemb, size_t size) {
+  // an empty slab goes back to the pool unless it is the class's last one
+  bool release = slab->free_count == slab->capacity &&
+                 (heap->partial[cls] != slab || slab->next != nullptr);
+  if (release) {
+    slabListRemove(heap->partial[cls], slab);
+    slab->magic = 0;
+  }
+  slabUnlock(heap, &heap->class_locks[cls]);
 
-  size_t size_of_allocation = nmemb * size;
-  void *ptr = customMalloc(size_of_allocation);
-  if (ptr != nullptr) {
-    memset(ptr, 0, size_of_allocation);
+  if (release) {
+    slabLock(heap, &heap->pool_lock);
+    slabListPush(heap->empty, slab);
+    slabUnlock(heap, &heap->pool_lock);
   }
-  return ptr;
+  return true;
 }
 
-void *customRealloc(void *ptr, size_t size) {
+// slab class for a request, -1 if it is too big for slabs
+static int slabClass(size_t size) {
+  return size <= SLAB_MAX_SIZE ? (int)((size + 15) >> 4) - 1 : -1;
+}
 
-  if (ptr == nullptr) {
-    return customMalloc(size);
-  }
+/*=============================================================================
+* heap profiling
+=============================================================================*/
+// about one allocation per profile_rate bytes is sampled: each thread counts
+// down a random, exponentially distributed number of bytes and samples the
+// allocation that crosses zero, so large objects are picked more often than
+// small ones in proportion to their size. a sample keeps the stack of the
+// malloc until the object is freed. samples live in an open addressing table
+// whose keys are read without the lock, so frees only lock for a sample. a
+// bitmap small enough to stay cached marks the home slots that have samples,
+// so a free of an object that was not sampled rarely reads the table. the
+// samples themselves are packed at the front of their own array, so the
+// pages they touch stay few and warm.
+#define PROFILE_TABLE_SIZE (64 * 1024) // live samples kept at most
+#define PROFILE_MAX_PROBES 64
+#define PROFILE_SKIP_FRAMES 1 // profileRecord, profileTick is inlined
+#define PROFILE_EMPTY 0
+#define PROFILE_REMOVED 1
+
+typedef struct ProfileSample {
+  size_t size;
+  bool mt; // which heap, so killing a heap drops its samples
+  int depth;
+  void *frames[PROFILE_MAX_DEPTH];
+} ProfileSample;
+
+static atomic<size_t> profile_rate(0);
+static size_t profile_last_rate = PROFILE_DEFAULT_RATE; // for the dump
+static atomic<size_t> profile_live(0);  // samples in the table
+static atomic<size_t> *profile_keys = nullptr; // sampled pointers
+static unsigned int *profile_index = nullptr;   // sample of each slot
+static ProfileSample *profile_samples = nullptr;
+static unsigned int *profile_spare = nullptr;   // stack of freed samples
+static size_t profile_spare_count = 0;
+static size_t profile_unused = 0; // samples past this were never used
+static atomic<unsigned long long> profile_homes[PROFILE_TABLE_SIZE / 64];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static thread_local size_t profile_countdown = 0; // bytes to the next sample
+static thread_local unsigned long long profile_seed = 0;
+static thread_local bool profile_busy = false; // backtrace may malloc
+
+// bytes to the next sample, exponentially distributed with mean rate
+static size_t profileInterval(size_t rate) {
+  if (profile_seed == 0)
+    profile_seed = (size_t)&profile_seed ^ (size_t)time(nullptr);
+  profile_seed = profile_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  double uniform = ((profile_seed >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (size_t)(-log(uniform) * rate) + 1;
+}
 
-  if (!is_pointer_in_heap(ptr)) {
-    string message = "<realloc error>: passed non-heap pointer";
-    cerr << message << endl;
-    return nullptr;
-  }
+static size_t profileSlot(void *ptr) {
+  return (size_t)(((size_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL) %
+         PROFILE_TABLE_SIZE;
+}
 
-  Block *block = (Block *)((char *)ptr - sizeof(Block));
-  size_t old_size = block->size;
-  size_t new_aligned_size = ALIGN_TO_MULT_OF_4(size);
+static bool profileHomeUsed(size_t home) {
+  return profile_homes[home / 64].load(memory_order_relaxed) &
+         (1ULL << (home % 64));
+}
 
-  // case shrinking / same size
-  if (new_aligned_size <= old_size) {
-    shrinking_block_split(block, new_aligned_size);
-    return ptr;
+// called with profile_lock held after a sample left the probe run of home
+static void profileUpdateHome(size_t home) {
+  size_t slot = home;
+  for (int i = 0; i < PROFILE_MAX_PROBES; i++) {
+    size_t key = profile_keys[slot].load(memory_order_relaxed);
+    if (key == PROFILE_EMPTY)
+      break;
+    if (key != PROFILE_REMOVED && profileSlot((void *)key) == home)
+      return; // another sample still starts there
+    slot = (slot + 1) % PROFILE_TABLE_SIZE;
   }
+  profile_homes[home / 64].fetch_and(~(1ULL << (home % 64)),
+                                     memory_order_relaxed);
+}
 
-  // case expanding
-  else {
+// the slot holding ptr, -1 if it is not sampled
+static long profileFind(void *ptr) {
+  size_t slot = profileSlot(ptr);
+  if (!profileHomeUsed(slot))
+    return -1;
+  for (int i = 0; i < PROFILE_MAX_PROBES; i++) {
+    size_t key = profile_keys[slot].load(memory_order_acquire);
+    if (key == (size_t)ptr)
+      return slot;
+    if (key == PROFILE_EMPTY)
+      return -1;
+    slot = (slot + 1) % PROFILE_TABLE_SIZE;
+  }
+  return -1;
+}
 
-    // collide with next block
-    if (block->next != nullptr && block->next->is_free) {
-      size_t potential_size = block->next->size + sizeof(Block) + block->size;
+// the table is mapped the first time sampling starts and kept from then on
+static bool profileTableReady() {
+  if (profile_keys != nullptr)
+    return true;
+  size_t bytes = PROFILE_TABLE_SIZE *
+                 (sizeof(ProfileSample) + sizeof(atomic<size_t>) +
+                  2 * sizeof(unsigned int));
+  void *table = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED)
+    return false;
+
+  char *next = (char *)table;
+  profile_samples = (ProfileSample *)next;
+  next += PROFILE_TABLE_SIZE * sizeof(ProfileSample);
+  profile_index = (unsigned int *)next;
+  next += PROFILE_TABLE_SIZE * sizeof(unsigned int);
+  profile_spare = (unsigned int *)next;
+  next += PROFILE_TABLE_SIZE * sizeof(unsigned int);
+  profile_keys = (atomic<size_t> *)next;
+  return true;
+}
 
-      // able to expand into next block
-      if (potential_size >= new_aligned_size) {
-        Block *next_block = block->next;
+// called with profile_lock held, the table never holds more samples than
+// it has slots
+static unsigned int profileTakeSample() {
+  if (profile_spare_count > 0)
+    return profile_spare[--profile_spare_count];
+  return profile_unused++;
+}
 
-        // pointer adjustment
-        block->next = next_block->next;
-        if (next_block->next != nullptr) {
-          next_block->next->prev = block;
-        }
-        block->size = potential_size;
-        block->is_free = false;
+// called with profile_lock held
+static void profileRemove(size_t slot) {
+  size_t key = profile_keys[slot].load(memory_order_relaxed);
+  profile_keys[slot].store(PROFILE_REMOVED, memory_order_release);
+  profile_spare[profile_spare_count++] = profile_index[slot];
+  profile_live.fetch_sub(1, memory_order_relaxed);
+  profileUpdateHome(profileSlot((void *)key));
+}
 
-        shrinking_block_split(block, new_aligned_size);
-        return ptr;
-      }
+__attribute__((noinline)) static void profileRecord(void *ptr, size_t size,
+                                                   bool mt) {
+  ProfileSample sample;
+  sample.size = size;
+  sample.mt = mt;
+  void *frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+  int depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES);
+  sample.depth = depth > PROFILE_SKIP_FRAMES ? depth - PROFILE_SKIP_FRAMES : 0;
+  memcpy(sample.frames, frames + PROFILE_SKIP_FRAMES,
+         sample.depth * sizeof(void *));
+
+  // a full probe run drops the sample
+  pthread_mutex_lock(&profile_lock);
+  size_t slot = profileSlot(ptr);
+  for (int i = 0; i < PROFILE_MAX_PROBES; i++) {
+    size_t key = profile_keys[slot].load(memory_order_relaxed);
+    if (key == PROFILE_EMPTY || key == PROFILE_REMOVED) {
+      size_t home = profileSlot(ptr);
+      profile_homes[home / 64].fetch_or(1ULL << (home % 64),
+                                        memory_order_relaxed);
+      profile_index[slot] = profileTakeSample();
+      profile_samples[profile_index[slot]] = sample;
+      profile_keys[slot].store((size_t)ptr, memory_order_release);
+      profile_live.fetch_add(1, memory_order_relaxed);
+      break;
     }
-    
-    // collide with previous block
-    if (block->prev != nullptr && block->prev->is_free) {
-      size_t potential_size = block->prev->size + sizeof(Block) + block->size;
-
-      // able to expand into previous block
-      if (potential_size >= new_aligned_size) {
-        Block *prev_block = block->prev;
-
-        // pointer adjustment
-        prev_block->next = block->next;
-        if (block->next != nullptr) {
-          block->next->prev = prev_block;
-        }
-        prev_block->size = potential_size;
-        prev_block->is_free = false;
+    slot = (slot + 1) % PROFILE_TABLE_SIZE;
+  }
+  pthread_mutex_unlock(&profile_lock);
+}
 
-        // copy data to new location
-        void *new_adr = (void *)((char *)prev_block + sizeof(Block));
-        memmove(new_adr, ptr, old_size);
+// counts size bytes against the thread's countdown and samples ptr when it
+// runs out. all that is paid while profiling is off is the load of the rate.
+__attribute__((always_inline)) static inline void
+profileTick(void *ptr, size_t size, bool mt) {
+  size_t rate = profile_rate.load(memory_order_relaxed);
+  if (__builtin_expect(rate == 0 || ptr == nullptr, true))
+    return;
+  if (profile_countdown > size) {
+    profile_countdown -= size;
+    return;
+  }
 
-        shrinking_block_split(prev_block, new_aligned_size);
-        return new_adr;
-      }
-    }
+  bool first = profile_seed == 0; // a thread starts counting, not sampling
+  profile_countdown = profileInterval(rate);
+  if (first || profile_busy)
+    return;
+  profile_busy = true;
+  profileRecord(ptr, size, mt);
+  profile_busy = false;
+}
 
-    
+// drops the sample of ptr, if it has one, when it is freed
+static inline void profileForget(void *ptr) {
+  if (__builtin_expect(profile_live.load(memory_order_relaxed) == 0, true))
+    return;
+  long slot = profileFind(ptr);
+  if (slot < 0)
+    return;
 
-    void *new_ptr = customMalloc(size);
-    if (new_ptr == nullptr) {
-      return nullptr; // allocation failed
-    }
+  pthread_mutex_lock(&profile_lock);
+  if (profile_keys[slot].load(memory_order_relaxed) == (size_t)ptr)
+    profileRemove(slot);
+  pthread_mutex_unlock(&profile_lock);
+}
 
-    memcpy(new_ptr, ptr, old_size);
-    customFree(ptr);
-    return new_ptr;
+// drops the samples of a heap that is being killed
+static void profileDropHeap(bool mt) {
+  if (profile_live.load(memory_order_relaxed) == 0)
+    return;
+  pthread_mutex_lock(&profile_lock);
+  for (size_t slot = 0; slot < PROFILE_TABLE_SIZE; slot++) {
+    size_t key = profile_keys[slot].load(memory_order_relaxed);
+    if (key > PROFILE_REMOVED && profile_samples[profile_index[slot]].mt == mt)
+      profileRemove(slot);
   }
+  pthread_mutex_unlock(&profile_lock);
 }
 
-void shrinking_block_split(Block *block, size_t new_size) {
-  // is the rest big enough to become a new block
-  if (block->size - new_size >= sizeof(Block) + 4) {
-
-    splitBlock(block, new_size);
-
-    Block *remainder = block->next;
-    remainder->is_free = true;
-    customFree((void *)((char *)remainder + sizeof(Block)));
+void customSetProfileRate(size_t rate) {
+  if (rate != 0) {
+    pthread_mutex_lock(&profile_lock);
+    bool ready = profileTableReady();
+    pthread_mutex_unlock(&profile_lock);
+    if (!ready)
+      return;
+
+    // the first backtrace loads the unwinder, which allocates
+    void *frame;
+    profile_busy = true;
+    backtrace(&frame, 1);
+    profile_busy = false;
   }
+  if (rate != 0)
+    profile_last_rate = rate;
+  profile_rate.store(rate, memory_order_relaxed);
 }
 
-// ---- Part B ----
-MemArea* area_head = nullptr;
-MemArea* current_area = nullptr;
-static void* mt_initial_break = nullptr;
-pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+/*=============================================================================
+* Part A
+=============================================================================*/
+static void *stMalloc(size_t size) {
 
-void heapMTCreate() {
-    if (mt_initial_break == nullptr) mt_initial_break = sbrk(0);
+  if (size == 0 || tooLarge(size))
+    return nullptr;
+
+  // small objects come from slabs when there is room for them
+  int slab_class = slabClass(size);
+  if (slab_class >= 0) {
+    if (!st_slabs_ready) {
+      slabHeapInit(&st_slabs, false);
+      st_slabs_ready = true;
+    }
+    void *object = slabAlloc(&st_slabs, slab_class);
+    if (object != nullptr)
+      return object;
+  }
 
-    MemArea* last_area = nullptr;
+  size_t aligned_size = alignedBlockSize(size);
 
-    for (int i = 0; i < NUM_AREAS; i++) {
-        // allocate memory for MemArea struct
-        MemArea* new_area = (MemArea*)sbrk(sizeof(MemArea));
-        
-        // allocate memory for area
-        size_t size = AREA_SIZE;
-        void* buffer = sbrk(size);
+  if (is_large_request(aligned_size)) {
+    Block *large = mmapBlock(aligned_size);
+    return large == nullptr ? nullptr : payloadOf(large);
+  }
 
-        pthread_mutex_init(&new_area->area_lock, nullptr);
+  if (block_list == nullptr) { // first allocation
 
-        // init first block in area
-        Block* first_block = (Block*)buffer;
-        first_block->size = size - sizeof(Block);
-        first_block->is_free = true;
-        first_block->next = nullptr;
-        first_block->prev = nullptr;
-        first_block->lock = &new_area->area_lock;
+    heapCreate();
+    Block *first = allocateBlock(aligned_size);
+    if (first == nullptr)
+      return nullptr;
 
-        new_area->rr_block_list = first_block;
-        new_area->next = nullptr;
+    return payloadOf(first);
+  }
 
-        // link areas
-        if (area_head == nullptr) {
-            area_head = new_area;
-            current_area = new_area;
-        } else {
-            last_area->next = new_area;
-        }
-        last_area = new_area;
-    }
-}
+  // a parked block of the same class needs no merging or splitting
+  Block *parked = quickPop(&st_bins, aligned_size);
+  if (parked != nullptr)
+    return payloadOf(parked);
 
-void heapMTKill() {
-    if (area_head == nullptr) return;
+  Block *best_fit = findBestFit(&st_bins, aligned_size);
+  if (best_fit == nullptr && st_bins.quick_count > 0) {
+    // merge what is parked and look again before growing the heap
+    quickFlush(&st_bins, releaseBlock);
+    best_fit = findBestFit(&st_bins, aligned_size);
+  }
 
-    MemArea* iter = area_head;
-    while (iter != nullptr) {
-        pthread_mutex_destroy(&iter->area_lock);
-        iter = iter->next;
-    }
+  // found a free block
+  if (best_fit != nullptr) {
+    binRemove(&st_bins, best_fit);
+    markUsed(best_fit);
 
-    area_head = nullptr;
-    current_area = nullptr;
-    if (mt_initial_break != nullptr) {
-        brk(mt_initial_break);
-        mt_initial_break = nullptr;
+    // check if block can be split
+    if (blockSize(best_fit) >= aligned_size + sizeof(Block) + MIN_BLOCK_SIZE) {
+      splitBlock(best_fit, aligned_size);
+      markFree(nextBlock(best_fit));
+      binInsert(&st_bins, nextBlock(best_fit));
     }
-}
-
-void *customMTMalloc(size_t size) {
-    if (size == 0) return nullptr;
-    size_t aligned_size = ALIGN_TO_MULT_OF_4(size);
-    
-    // check if size is larger than area size - block size
-    if (aligned_size > AREA_SIZE - sizeof(Block)) return nullptr;
 
-    // RR loop
-    MemArea* start_area = current_area;
-    MemArea* iter = start_area;
+    // return a pointer to memory after the block metadata
+    return payloadOf(best_fit);
+  } else { // didn't find a free block, extend heap
+    Block *new_block = allocateBlock(aligned_size);
+    if (new_block == nullptr)
+      return nullptr;
+    // return pointer to memory allocated for user
+    return payloadOf(new_block);
+  }
+}
 
-    do {
-        // Lock current area
-        pthread_mutex_lock(&iter->area_lock);
-
-        // search for best fit
-        Block* best_fit = find_best_fit(size, iter->rr_block_list);
-
-        if (best_fit != nullptr) {
-            // found a free block
-            
-            // if we can split the block - do it
-            if (best_fit-> size >= aligned_size + sizeof(Block) + 4) {
-                splitBlock(best_fit, aligned_size);
-
-                // updatre the lock for the new block
-                if (best_fit->next != nullptr) {
-                    best_fit->next->lock = &iter->area_lock;
-                }
-            }
+void *customMalloc(size_t size) {
+  void *ptr = stMalloc(size);
+  profileTick(ptr, size, false);
+  return ptr;
+}
 
-            best_fit->is_free = false;
-            best_fit->lock = &iter->area_lock;
-            pthread_mutex_unlock(&iter->area_lock);
+// cuts an in use block after size_offset bytes. the remainder becomes a new in
+// use block, the caller decides what to do with it.
+void splitBlock(Block *block, size_t size_offset) {
 
-            // advance the current area pointer
-            current_area = (iter->next != nullptr) ? iter->next : area_head;
-            return (void *)((char *)best_fit + sizeof(Block));
-        }
-        // block wasn't found in the current area
-        pthread_mutex_unlock(&iter->area_lock);
-        iter = (iter->next != nullptr) ? iter->next : area_head;
+  Block *remainder = (Block *)((char *)block + sizeof(Block) + size_offset);
 
-    } while (iter != start_area); 
+  remainder->size = blockSize(block) - size_offset - sizeof(Block);
+  remainder->magic = blockMagic(remainder);
+  remainder->area_id = block->area_id;
 
-    
-    // block wasn't found, need to allocate a new area
-    pthread_mutex_lock(&global_lock);
-    MemArea* new_area = (MemArea*)sbrk(sizeof(MemArea));
-    void* buffer = sbrk(AREA_SIZE);
+  setBlockSize(block, size_offset);
+}
 
-    pthread_mutex_init(&new_area->area_lock, nullptr);
+// cuts the front off an in use block so its payload starts at a multiple of
+// alignment. the front becomes a block of its own and is handed to release,
+// which is why it is either empty or big enough to be a free block. the block
+// has to be at least alignedPadding(alignment) bytes bigger than needed.
+static Block *carveAligned(Block *block, size_t alignment,
+                           void (*release)(Block *)) {
+  size_t payload = (size_t)payloadOf(block);
+  size_t gap = ALIGN_UP(payload, alignment) - payload;
+  if (gap == 0)
+    return block;
+  if (gap < sizeof(Block) + MIN_BLOCK_SIZE)
+    gap += alignment;
+
+  splitBlock(block, gap - sizeof(Block));
+  Block *aligned = nextBlock(block);
+  release(block);
+  return aligned;
+}
 
-    Block* blk = (Block*)buffer;
-    blk->size = AREA_SIZE - sizeof(Block);
-    blk->is_free = true;
-    blk->next = nullptr;
-    blk->prev = nullptr;
-    blk->lock = &new_area->area_lock;
+// worst case front cut of carveAligned
+static size_t alignedPadding(size_t alignment) {
+  return alignment + alignedBlockSize(sizeof(Block) + MIN_BLOCK_SIZE);
+}
 
-    new_area->rr_block_list = blk;
-    new_area->next = nullptr;
+static void *stAlignedAlloc(size_t alignment, size_t size) {
+  if (size == 0 || tooLarge(size) || tooLarge(alignment) ||
+      tooLarge(size + alignment) || alignment == 0 ||
+      (alignment & (alignment - 1)) != 0)
+    return nullptr;
+  if (alignment <= CUSTOM_ALIGNMENT)
+    return stMalloc(size);
+
+  // large ones get a mapping of their own like any large block
+  size_t aligned_size = alignedBlockSize(size);
+  if (is_large_request(aligned_size)) {
+    Block *large = mmapAlignedBlock(aligned_size, alignment);
+    return large == nullptr ? nullptr : payloadOf(large);
+  }
 
-    // link to the end of the area list
-    MemArea* tmp = area_head;
-    while (tmp->next != nullptr) tmp = tmp->next;
-    tmp->next = new_area;
+  // the rest come from the heap, not from slabs, so the cut off front and
+  // tail go back to the free lists
+  size_t padded_size = aligned_size + alignedPadding(alignment);
 
-    pthread_mutex_unlock(&global_lock);
+  if (block_list == nullptr)
+    heapCreate();
 
-    // now we can allocate from the new area
-    pthread_mutex_lock(&new_area->area_lock);
-    Block* final_res = find_best_fit(size, new_area->rr_block_list);
-
-    if (final_res != nullptr) {
-        
-        if (final_res->size >= aligned_size + sizeof(Block) + 4) {
-            splitBlock(final_res, aligned_size);
-            final_res->next->lock = &new_area->area_lock;
-        }
+  Block *block = findBestFit(&st_bins, padded_size);
+  if (block != nullptr) {
+    binRemove(&st_bins, block);
+    markUsed(block);
+  } else {
+    block = allocateBlock(padded_size);
+    if (block == nullptr)
+      return nullptr;
+  }
 
-        final_res->is_free = false;
-        final_res->lock = &new_area->area_lock;
-        pthread_mutex_unlock(&new_area->area_lock);
-        return (void *)((char*)final_res + sizeof(Block));
-    }
-    return nullptr; // shouldn't reach here (fail-safe)
+  block = carveAligned(block, alignment, releaseBlock);
+  shrinking_block_split(block, aligned_size);
+  return payloadOf(block);
 }
 
-void customMTFree(void *ptr) {
-    if (ptr == nullptr) return;
+void *customAlignedAlloc(size_t alignment, size_t size) {
+  void *ptr = stAlignedAlloc(alignment, size);
+  profileTick(ptr, size, false);
+  return ptr;
+}
 
-    Block* block = (Block*)((char*)ptr - sizeof(Block));
+// extends the heap by a new in use block that takes the place of the fence
+Block *allocateBlock(size_t aligned_size) {
 
-    // check for lock
-    if (block->lock != nullptr) pthread_mutex_lock(block->lock);
-    block->is_free = true;
+  // a new heap also needs room for its fence. if someone else moved the break
+  // since we last grew, the new block can't continue the old heap either.
+  char *fence_end = (char *)st_fence + sizeof(Block);
+  char *current_break = (char *)sbrk(0);
+  bool contiguous = st_fence != nullptr && current_break == fence_end;
+  // someone else may have used the break memory past our heap
+  char *zero_from = contiguous ? st_zero_from
+                               : (char *)ALIGN_UP((size_t)current_break,
+                                                  pageSize());
 
-    // try to coalesce
-    tryCoalesce(block);
+  // allocate space for block metadata + requested size
+  size_t total_size = sizeof(Block) + aligned_size;
+  size_t pad = 0;
+  if (!contiguous) {
+    pad = ALIGN_UP((size_t)current_break, CUSTOM_ALIGNMENT) -
+          (size_t)current_break; // keep headers aligned
+    total_size += pad + sizeof(Block);
+  }
 
-    if (block->lock != nullptr) pthread_mutex_unlock(block->lock);
-}
+  void *result = sbrk(total_size);
+  st_sbrk_calls++;
 
-void *customMTCalloc(size_t nmemb, size_t size) {
-    size_t total_size = nmemb * size;
-    void* ptr = customMTMalloc(total_size);
-    if (ptr != nullptr) {
-      memset(ptr, 0, total_size);
+  // errors
+  if (result == SBRK_FAIL) {
+    if (errno == ENOMEM) {
+      heapKill();
+      cerr << "<sbrk/brk error>: out of memory" << endl;
+      exit(1);
+    }
+    return nullptr; // other sbrk error
+  }
+
+  // Create a new block
+  Block *new_block;
+  if (contiguous) {
+    new_block = st_fence; // keeps the fence's BLOCK_PREV_FREE
+  } else {
+    new_block = (Block *)((char *)result + pad);
+    new_block->size = 0;
+    if (st_fence != nullptr) {
+      // the old fence becomes a block that is never free and covers the
+      // foreign memory up to the new block
+      setBlockSize(st_fence, (char *)new_block - fence_end);
+    } else {
+      block_list = new_block;
+    }
+  }
+
+  // metadata
+  setBlockSize(new_block, aligned_size);
+  new_block->magic = blockMagic(new_block);
+  new_block->area_id = 0;
+
+  st_fence = nextBlock(new_block);
+  writeFence(st_fence, 0);
+
+  char *new_break = (char *)st_fence + sizeof(Block);
+  st_zero_from = zero_from > new_break ? zero_from : new_break;
+  char *payload = (char *)payloadOf(new_block);
+  st_fresh_block = new_block;
+  st_fresh_dirty = zero_from > payload ? zero_from - payload : 0;
+
+  return new_block;
+}
+
+// merges block with its free neighbours, which are taken off their free lists.
+// the merged block itself is not put on a list.
+void tryCoalesce(Block *&block, FreeBins *bins) {
+
+  // previous block
+  if (block->size & BLOCK_PREV_FREE) {
+
+    Block *block_to_coalesce = prevFreeBlock(block);
+    binRemove(bins, block_to_coalesce);
+
+    // adjust new size
+    size_t new_size =
+        blockSize(block_to_coalesce) + blockSize(block) + sizeof(Block);
+    setBlockSize(block_to_coalesce, new_size);
+    block->magic = 0; // header is now inside the merged block
+
+    block = block_to_coalesce; // block pointer to previous block
+  }
+
+  // next block
+  Block *block_to_coalesce = nextBlock(block);
+  if (isFree(block_to_coalesce)) {
+
+    binRemove(bins, block_to_coalesce);
+
+    // adjust new size
+    size_t new_size =
+        blockSize(block_to_coalesce) + blockSize(block) + sizeof(Block);
+    setBlockSize(block, new_size);
+    block_to_coalesce->magic = 0;
+  }
+}
+
+// takes the free block after block into it. block stays in use.
+static void absorbNext(Block *block, FreeBins *bins) {
+  Block *next = nextBlock(block);
+  binRemove(bins, next);
+  next->magic = 0;
+  setBlockSize(block, blockSize(block) + sizeof(Block) + blockSize(next));
+  nextBlock(block)->size &= ~(size_t)BLOCK_PREV_FREE;
+}
+
+// grows an in use block to aligned_size by taking in the free block before
+// it, and the one after it too if that is free. the payload moves down to the
+// start of the previous block. returns the grown block, still to be split, or
+// nullptr if the neighbours are not free or too small.
+static Block *growIntoNeighbours(Block *block, size_t aligned_size,
+                                 FreeBins *bins) {
+  if (!(block->size & BLOCK_PREV_FREE))
+    return nullptr;
+
+  Block *prev = prevFreeBlock(block);
+  Block *next = nextBlock(block);
+  size_t old_size = blockSize(block);
+  size_t total = blockSize(prev) + sizeof(Block) + old_size;
+  if (isFree(next))
+    total += sizeof(Block) + blockSize(next);
+  if (total < aligned_size)
+    return nullptr;
+
+  if (isFree(next))
+    absorbNext(block, bins);
+  binRemove(bins, prev);
+  block->magic = 0; // header is now inside the grown block
+  setBlockSize(prev, blockSize(prev) + sizeof(Block) + blockSize(block));
+  prev->size &= ~(size_t)BLOCK_FREE;
+
+  memmove(payloadOf(prev), payloadOf(block), old_size);
+  return prev;
+}
+
+// O(1) check that ptr is the payload of a live block: it has to lie between
+// the first block of the heap and the fence, and the header in front of it has
+// to carry the magic word for its address
+// between the first payload and the fence, where no mapping can be
+static bool inHeapRange(void *ptr) {
+  return block_list != nullptr && (char *)ptr >= (char *)payloadOf(block_list) &&
+         (char *)ptr <= (char *)st_fence;
+}
+
+bool is_pointer_in_heap(void *ptr) {
+  if (!inHeapRange(ptr))
+    return false;
+
+  Block *block = headerOf(ptr);
+  return block->magic == blockMagic(block) && !isFree(block);
+}
+
+/*=============================================================================
+* large allocations
+=============================================================================*/
+// blocks at or above the mmap threshold live alone in a private mapping, with
+// the header at the start of the first page, or further in for an aligned
+// one. they never touch the break or an area and go back to the OS as soon as
+// they are freed.
+static size_t pageSize() {
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+// 0, which mmap and mremap refuse, for sizes no mapping can have
+static size_t mappingSize(size_t aligned_size) {
+  if (tooLarge(aligned_size))
+    return 0;
+  size_t page_mask = pageSize() - 1;
+  return (sizeof(Block) + aligned_size + page_mask) & ~page_mask;
+}
+
+// live mappings by header address, so a pointer is known to be one before
+// its header is read. open addressing with linear probing, the table lives in
+// a mapping of its own and doubles when half full. the lock is a leaf,
+// nothing else is taken while it is held.
+#define MAPPING_MIN_SLOTS 512
+
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+static Block **mapping_slots = nullptr;
+static size_t mapping_capacity = 0; // a power of two once there is a table
+static unsigned int mapping_shift = 0;
+static size_t mapping_count = 0;
+
+// fibonacci hashing on the top bits, headers are 16 byte aligned
+static size_t mappingHash(Block *block) {
+  return (size_t)((((unsigned long long)block >> 4) * 0x9E3779B97F4A7C15ULL) >>
+                  mapping_shift);
+}
+
+// block's slot, or the empty one that ends its probe run. called with
+// mapping_lock held and a table.
+static size_t mappingFind(Block *block) {
+  size_t mask = mapping_capacity - 1;
+  size_t i = mappingHash(block);
+  while (mapping_slots[i] != nullptr && mapping_slots[i] != block)
+    i = (i + 1) & mask;
+  return i;
+}
+
+// called with mapping_lock held
+static bool mappingGrow() {
+  size_t capacity =
+      mapping_capacity == 0 ? MAPPING_MIN_SLOTS : mapping_capacity * 2;
+  void *table = mmap(nullptr, capacity * sizeof(Block *),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED)
+    return false;
+
+  Block **old_slots = mapping_slots;
+  size_t old_capacity = mapping_capacity;
+  mapping_slots = (Block **)table;
+  mapping_capacity = capacity;
+  mapping_shift = 64 - __builtin_ctzll(capacity);
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_slots[i] != nullptr)
+      mapping_slots[mappingFind(old_slots[i])] = old_slots[i];
+  }
+  if (old_slots != nullptr)
+    munmap(old_slots, old_capacity * sizeof(Block *));
+  return true;
+}
+
+// called with mapping_lock held. false if the table could not grow.
+static bool mappingInsert(Block *block) {
+  if ((mapping_count + 1) * 2 > mapping_capacity && !mappingGrow())
+    return false;
+  mapping_slots[mappingFind(block)] = block;
+  mapping_count++;
+  return true;
+}
+
+// called with mapping_lock held. the entries after the hole shift back into
+// it where their probe run allows, so no run is ever broken.
+static void mappingRemove(Block *block) {
+  if (mapping_capacity == 0)
+    return;
+  size_t mask = mapping_capacity - 1;
+  size_t hole = mappingFind(block);
+  if (mapping_slots[hole] == nullptr)
+    return;
+
+  mapping_count--;
+  for (size_t i = (hole + 1) & mask; mapping_slots[i] != nullptr;
+       i = (i + 1) & mask) {
+    size_t home = mappingHash(mapping_slots[i]);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      mapping_slots[hole] = mapping_slots[i];
+      hole = i;
+    }
+  }
+  mapping_slots[hole] = nullptr;
+}
+
+static bool isLiveMapping(Block *block) {
+  pthread_mutex_lock(&mapping_lock);
+  bool live = mapping_capacity != 0 &&
+              mapping_slots[mappingFind(block)] != nullptr;
+  pthread_mutex_unlock(&mapping_lock);
+  return live;
+}
+
+void customSetMmapThreshold(size_t threshold) {
+  mmap_threshold.store(threshold, memory_order_relaxed);
+}
+
+bool is_large_request(size_t aligned_size) {
+  return aligned_size >= mmap_threshold.load(memory_order_relaxed);
+}
+
+// a mapped block has no area, area_id holds the bytes of its mapping in
+// front of the header instead. 0 unless the block was mapped aligned.
+static size_t mappingFront(Block *block) { return block->area_id; }
+
+// registers the block that starts front bytes into a new mapping of length
+// bytes, which is unmapped again if the registry has no room
+static Block *mappedBlock(char *start, size_t length, size_t front) {
+  Block *block = (Block *)(start + front);
+  pthread_mutex_lock(&mapping_lock);
+  bool registered = mappingInsert(block);
+  pthread_mutex_unlock(&mapping_lock);
+  if (!registered) {
+    munmap(start, length);
+    return nullptr;
+  }
+
+  mmap_calls.fetch_add(1, memory_order_relaxed);
+  large_blocks.fetch_add(1, memory_order_relaxed);
+  large_bytes.fetch_add(length, memory_order_relaxed);
+
+  block->size = (length - front - sizeof(Block)) | BLOCK_MMAPPED;
+  block->magic = blockMagic(block);
+  block->area_id = (unsigned int)front;
+  return block;
+}
+
+Block *mmapBlock(size_t aligned_size) {
+  size_t length = mappingSize(aligned_size);
+  void *result = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED)
+    return nullptr;
+  return mappedBlock((char *)result, length, 0);
+}
+
+// a block whose payload is aligned to alignment, a power of two above
+// CUSTOM_ALIGNMENT. the mapping is made alignment bytes longer, then the
+// whole pages in front of the header's page and past the block are cut off.
+static Block *mmapAlignedBlock(size_t aligned_size, size_t alignment) {
+  size_t page_mask = pageSize() - 1;
+  size_t raw_length = mappingSize(aligned_size + alignment);
+  if (raw_length == 0)
+    return nullptr;
+  char *raw = (char *)mmap(nullptr, raw_length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return nullptr;
+
+  size_t payload = ALIGN_UP((size_t)raw + sizeof(Block), alignment);
+  char *header = (char *)payload - sizeof(Block);
+  char *start = (char *)((size_t)header & ~page_mask);
+  size_t front = header - start;
+  size_t length = mappingSize(front + aligned_size);
+  if (start > raw)
+    munmap(raw, start - raw);
+  if (start + length < raw + raw_length)
+    munmap(start + length, raw + raw_length - (start + length));
+  return mappedBlock(start, length, front);
+}
+
+void munmapBlock(Block *block) {
+  size_t front = mappingFront(block);
+  size_t length = front + sizeof(Block) + blockSize(block);
+  large_blocks.fetch_sub(1, memory_order_relaxed);
+  large_bytes.fetch_sub(length, memory_order_relaxed);
+  pthread_mutex_lock(&mapping_lock);
+  mappingRemove(block);
+  pthread_mutex_unlock(&mapping_lock);
+  block->magic = 0;
+  munmap((char *)block - front, length);
+}
+
+// grows or shrinks the mapping, moving it if needed. nullptr on failure, in
+// which case the old block is untouched. a moved aligned block keeps its
+// page offset, not its alignment, as realloc does not promise it.
+Block *mremapBlock(Block *block, size_t aligned_size) {
+  size_t front = mappingFront(block);
+  size_t length = mappingSize(front + aligned_size);
+  if (length == 0)
+    return nullptr;
+  size_t old_length = front + sizeof(Block) + blockSize(block);
+  void *result =
+      mremap((char *)block - front, old_length, length, MREMAP_MAYMOVE);
+  if (result == MAP_FAILED)
+    return nullptr;
+
+  // the old entry's slot is freed first, so the new one always fits
+  Block *moved = (Block *)((char *)result + front);
+  pthread_mutex_lock(&mapping_lock);
+  mappingRemove(block);
+  mappingInsert(moved);
+  pthread_mutex_unlock(&mapping_lock);
+
+  mmap_calls.fetch_add(1, memory_order_relaxed);
+  large_bytes.fetch_add(length - old_length, memory_order_relaxed);
+
+  setBlockSize(moved, length - front - sizeof(Block));
+  moved->magic = blockMagic(moved);
+  return moved;
+}
+
+// a mapped block's header sits in front of ptr, in the first page of its
+// mapping. only one the registry knows is read, a freed or stray one may not
+// be mapped. heap pointers are ruled out without taking the registry lock.
+bool is_mmapped_pointer(void *ptr) {
+  size_t header = (size_t)ptr - sizeof(Block);
+  if ((size_t)ptr < sizeof(Block) || header % CUSTOM_ALIGNMENT != 0 ||
+      inHeapRange(ptr))
+    return false;
+
+  Block *block = (Block *)header;
+  return isLiveMapping(block) && block->magic == blockMagic(block) &&
+         isMmapped(block);
+}
+
+/*=============================================================================
+* trimming
+=============================================================================*/
+void customSetTrimThreshold(size_t threshold) { trim_threshold = threshold; }
+
+// the block is followed by the fence and nobody else moved the break since
+static bool isHeapTop(Block *block) {
+  char *fence_end = (char *)st_fence + sizeof(Block);
+  return nextBlock(block) == st_fence && sbrk(0) == fence_end;
+}
+
+// gives the top of the heap back to the OS. block is the last block, in use
+// and on no list. keep bytes of it stay as a free block, 0 drops it entirely.
+static void shrinkHeapTop(Block *block, size_t keep) {
+  size_t size_to_release;
+  if (keep > 0) {
+    size_to_release = blockSize(block) - keep;
+    setBlockSize(block, keep);
+    st_fence = nextBlock(block);
+    writeFence(st_fence, 0);
+    markFree(block);
+    binInsert(&st_bins, block);
+  } else if (block == block_list) {
+    // the heap is empty, the fence goes too
+    size_to_release = 2 * sizeof(Block) + blockSize(block);
+    block_list = nullptr;
+    st_fence = nullptr;
+  } else {
+    // the block before is in use after coalescing
+    size_to_release = sizeof(Block) + blockSize(block);
+    st_fence = block;
+    writeFence(st_fence, 0);
+  }
+  sbrk(-size_to_release); // release memory back to OS
+  st_sbrk_calls++;
+
+  char *page_end = (char *)ALIGN_UP((size_t)sbrk(0), pageSize());
+  if (page_end < st_zero_from)
+    st_zero_from = page_end;
+}
+
+// grows the last block, in use, to aligned_size by moving the break and the
+// fence behind it. false if sbrk fails, the block is unchanged then.
+static bool growHeapTop(Block *block, size_t aligned_size) {
+  if (sbrk(aligned_size - blockSize(block)) == SBRK_FAIL)
+    return false;
+  st_sbrk_calls++;
+
+  setBlockSize(block, aligned_size);
+  st_fence = nextBlock(block);
+  writeFence(st_fence, 0);
+
+  char *new_break = (char *)st_fence + sizeof(Block);
+  if (new_break > st_zero_from)
+    st_zero_from = new_break;
+  return true;
+}
+
+// drops the whole pages of [from, to) inside a free block. its links and
+// footer stay, the rest reads back as zeros when touched again. true if any
+// page went back.
+static bool adviseFreeBlock(Block *block, char *from, char *to) {
+  size_t page_mask = pageSize() - 1;
+  size_t start = (size_t)payloadOf(block) + sizeof(FreeLinks);
+  size_t end = (size_t)payloadOf(block) + blockSize(block) - sizeof(size_t);
+  if ((size_t)from > start)
+    start = (size_t)from;
+  if ((size_t)to < end)
+    end = (size_t)to;
+  start = (start + page_mask) & ~page_mask;
+  end &= ~page_mask;
+  if (end <= start)
+    return false;
+  return madvise((void *)start, end - start, MADV_DONTNEED) == 0;
+}
+
+// the part of block and its free neighbours that may still hold pages, taken
+// before they merge. neighbours big enough were advised when they were freed.
+static void unadvisedSpan(Block *block, char *&from, char *&to) {
+  from = (char *)block;
+  to = (char *)nextBlock(block);
+  if (block->size & BLOCK_PREV_FREE) {
+    Block *prev = prevFreeBlock(block);
+    if (blockSize(prev) < TRIM_INTERIOR_MIN)
+      from = (char *)prev;
+  }
+  Block *next = nextBlock(block);
+  if (isFree(next) && blockSize(next) < TRIM_INTERIOR_MIN)
+    to = (char *)nextBlock(next);
+}
+
+static bool adviseAllFreeBlocks(FreeBins *bins) {
+  bool released = false;
+  for (size_t cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+    for (Block *block = bins->heads[cls]; block != nullptr;
+         block = linksOf(block)->next_free) {
+      released |= adviseFreeBlock(block, (char *)block, (char *)nextBlock(block));
+    }
+  }
+  return released;
+}
+
+// marks a block free, merges it with its neighbours and either returns it to
+// the OS (last block) or files it in its size class
+void releaseBlock(Block *block) {
+  char *from, *to;
+  unadvisedSpan(block, from, to);
+  tryCoalesce(block, &st_bins);
+
+  // a free top of at least trim_threshold bytes goes back to the OS
+  if (isHeapTop(block) && sizeof(Block) + blockSize(block) >= trim_threshold) {
+    shrinkHeapTop(block, 0);
+  } else {
+    markFree(block);
+    binInsert(&st_bins, block);
+    if (blockSize(block) >= TRIM_INTERIOR_MIN)
+      adviseFreeBlock(block, from, to);
+  }
+}
+
+int customTrim(size_t pad) {
+  if (block_list == nullptr)
+    return 0;
+
+  char *old_break = (char *)sbrk(0);
+  quickFlush(&st_bins, releaseBlock); // parked blocks can go too
+
+  // cut a free top down to pad bytes
+  if (st_fence != nullptr && (st_fence->size & BLOCK_PREV_FREE)) {
+    Block *last = prevFreeBlock(st_fence);
+    size_t keep = pad == 0 ? 0 : alignedBlockSize(pad);
+    if (isHeapTop(last) && blockSize(last) > keep) {
+      binRemove(&st_bins, last);
+      markUsed(last);
+      shrinkHeapTop(last, keep);
+    }
+  }
+
+  bool released = adviseAllFreeBlocks(&st_bins);
+  return released || (char *)sbrk(0) < old_break;
+}
+
+// deferred mode parks the block, merging waits for a batch
+static void freeHeapBlock(Block *block) {
+  if (st_deferred && quickPush(&st_bins, block)) {
+    if (st_bins.quick_count > QUICK_MAX_BLOCKS)
+      quickFlush(&st_bins, releaseBlock);
+    return;
+  }
+  releaseBlock(block);
+}
+
+void customFree(void *ptr) {
+
+  // check if null
+  if (ptr == nullptr) {
+    string message = "<free error>: passed null pointer";
+    cerr << message << endl;
+    return;
+  }
+
+  profileForget(ptr);
+
+  // slab objects are validated by the slab itself
+  if (isSlabPointer(&st_slabs, ptr)) {
+    if (!slabFree(&st_slabs, ptr)) {
+      string message = "<free error>: passed non-heap pointer";
+      cerr << message << endl;
+    }
+    return;
+  }
+
+  // large blocks go straight back to the OS
+  if (is_mmapped_pointer(ptr)) {
+    munmapBlock(headerOf(ptr));
+    return;
+  }
+
+  // check if pointer is valid
+  if (!is_pointer_in_heap(ptr)) {
+    string message = "<free error>: passed non-heap pointer";
+    cerr << message << endl;
+    return;
+  }
+
+  freeHeapBlock(headerOf(ptr));
+}
+
+#ifndef NDEBUG
+// ptr is a live slab object or in use block that size fits. a pointer
+// parked in a thread cache still looks live, freeing it twice goes unseen.
+static bool sizedFreeMatches(SlabHeap *heap, void *ptr, size_t size) {
+  if (isSlabPointer(heap, ptr))
+    return slabIsLive(heap, ptr) && slabClass(size) >= 0 &&
+           size <= slabObjectSize(ptr);
+  Block *block = headerOf(ptr);
+  return block->magic == blockMagic(block) && !isFree(block) &&
+         size <= blockSize(block);
+}
+#endif
+
+void customFreeSized(void *ptr, size_t size) {
+  if (ptr == nullptr) {
+    customFree(ptr);
+    return;
+  }
+  assert(isSlabPointer(&st_slabs, ptr)
+             ? slabIsLive(&st_slabs, ptr)
+             : is_mmapped_pointer(ptr) || is_pointer_in_heap(ptr));
+  assert(sizedFreeMatches(&st_slabs, ptr, size));
+  profileForget(ptr);
+
+  // a small object is a slab object unless the slabs were full
+  if (slabClass(size) >= 0 && isSlabPointer(&st_slabs, ptr)) {
+    slabFree(&st_slabs, ptr);
+    return;
+  }
+
+  Block *block = headerOf(ptr);
+  if (isMmapped(block)) {
+    munmapBlock(block);
+    return;
+  }
+  freeHeapBlock(block);
+}
+
+void *customCalloc(size_t nmemb, size_t size) {
+
+  size_t size_of_allocation;
+  if (__builtin_mul_overflow(nmemb, size, &size_of_allocation)) {
+    string message = "<calloc error>: size overflow";
+    cerr << message << endl;
+    return nullptr;
+  }
+
+  st_fresh_block = nullptr;
+  void *ptr = customMalloc(size_of_allocation);
+  if (ptr == nullptr)
+    return nullptr;
+
+  // fresh mappings are zero, and so is fresh break memory past st_zero_from
+  size_t dirty = size_of_allocation;
+  if (is_mmapped_pointer(ptr))
+    dirty = 0;
+  else if (headerOf(ptr) == st_fresh_block && st_fresh_dirty < dirty)
+    dirty = st_fresh_dirty;
+  memset(ptr, 0, dirty);
+  return ptr;
+}
+
+static void *stRealloc(void *ptr, size_t size) {
+
+  if (ptr == nullptr) {
+    return stMalloc(size);
+  }
+  if (tooLarge(size))
+    return nullptr; // the old block is untouched
+
+  if (is_mmapped_pointer(ptr)) {
+    Block *moved = mremapBlock(headerOf(ptr), alignedBlockSize(size));
+    return moved == nullptr ? nullptr : payloadOf(moved);
+  }
+
+  // a slab object stays if it still fits, otherwise it moves out
+  if (isSlabPointer(&st_slabs, ptr)) {
+    if (!slabIsLive(&st_slabs, ptr)) {
+      string message = "<realloc error>: passed non-heap pointer";
+      cerr << message << endl;
+      return nullptr;
+    }
+
+    size_t object_size = slabObjectSize(ptr);
+    if (size <= object_size)
+      return ptr;
+
+    void *new_ptr = stMalloc(size);
+    if (new_ptr == nullptr)
+      return nullptr;
+    memcpy(new_ptr, ptr, object_size);
+    slabFree(&st_slabs, ptr);
+    return new_ptr;
+  }
+
+  if (!is_pointer_in_heap(ptr)) {
+    string message = "<realloc error>: passed non-heap pointer";
+    cerr << message << endl;
+    return nullptr;
+  }
+
+  Block *block = headerOf(ptr);
+  size_t old_size = blockSize(block);
+  size_t new_aligned_size = alignedBlockSize(size);
+
+  // case shrinking / same size
+  if (new_aligned_size <= old_size) {
+    shrinking_block_split(block, new_aligned_size);
+    return ptr;
+  }
+
+  // case expanding
+  else {
+
+    // the next block alone, or the top of the heap moved up with the break
+    // after taking in a free block in front of the fence. the payload stays.
+    Block *next_block = nextBlock(block);
+    if (isFree(next_block) &&
+        (old_size + sizeof(Block) + blockSize(next_block) >= new_aligned_size ||
+         isHeapTop(next_block))) {
+      absorbNext(block, &st_bins);
+    }
+    if (blockSize(block) < new_aligned_size && isHeapTop(block)) {
+      growHeapTop(block, new_aligned_size);
+    }
+    if (blockSize(block) >= new_aligned_size) {
+      shrinking_block_split(block, new_aligned_size);
+      return ptr;
+    }
+
+    // both neighbours together, moving the payload down
+    Block *grown = growIntoNeighbours(block, new_aligned_size, &st_bins);
+    if (grown != nullptr) {
+      shrinking_block_split(grown, new_aligned_size);
+      return payloadOf(grown);
+    }
+
+    void *new_ptr = stMalloc(size);
+    if (new_ptr == nullptr) {
+      return nullptr; // allocation failed
+    }
+
+    memcpy(new_ptr, ptr, old_size);
+    customFree(ptr);
+    return new_ptr;
+  }
+}
+
+// a resize counts as a free of ptr and a malloc of what it returns
+void *customRealloc(void *ptr, size_t size) {
+  if (ptr != nullptr)
+    profileForget(ptr);
+  void *moved = stRealloc(ptr, size);
+  profileTick(moved, size, false);
+  return moved;
+}
+
+void shrinking_block_split(Block *block, size_t new_size) {
+  // is the rest big enough to become a new block
+  if (blockSize(block) - new_size >= sizeof(Block) + MIN_BLOCK_SIZE) {
+
+    splitBlock(block, new_size);
+    releaseBlock(nextBlock(block));
+  }
+}
+
+// ---- Part B ----
+// the area list only ever grows while the heap is alive. new areas are
+// published at the tail with CAS, so readers walk it without a lock.
+atomic<MemArea*> area_head(nullptr);
+static atomic<MemArea*> area_tail(nullptr);
+static atomic<size_t> area_count(0);
+// areas by id, so a block header only needs a 32 bit index to find its area.
+// id 0 stands for no area.
+static MemArea* area_table[MAX_AREAS];
+static atomic<unsigned int> next_area_id(1);
+static atomic<unsigned int> next_home(0);
+// size of the next area created on demand, doubling up to max_area_size
+static atomic<size_t> next_area_size(AREA_SIZE);
+static size_t max_area_size = DEFAULT_MAX_AREA_SIZE;
+
+// bumped by heapMTKill so thread caches drop blocks of a dead heap
+static atomic<unsigned long> mt_generation(1);
+static SlabHeap mt_slabs;
+static bool mt_deferred = false; // HeapConfig::deferred_coalescing
+// HeapConfig::per_cpu_areas: the area each CPU allocates from, picked by
+// sched_getcpu() % num_cpu_areas
+static bool mt_per_cpu = false;
+static atomic<MemArea*> cpu_areas[MAX_CPU_AREAS];
+static size_t num_cpu_areas = 0;
+static bool mt_huge_pages = false; // HeapConfig::huge_pages
+static bool mt_mutex_locks = false; // HeapConfig::mutex_area_locks
+
+/*=============================================================================
+* area locks
+=============================================================================*/
+// a waiter spins up to twice what recent acquisitions needed, so a lock whose
+// holders come and go quickly is waited for on the CPU, and one that makes
+// spinning fail goes to sleep almost at once. the pause between two looks at
+// the lock doubles each time. one CPU never spins, the holder cannot run.
+#define AREA_SPIN_MIN 16
+#define AREA_SPIN_MAX 200
+#define AREA_BACKOFF_MAX 64 // pauses between two looks at the lock
+
+static int area_spin_max = 0; // 0 on one CPU
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+static void lockInit(AreaLock* lock) {
+    lock->state.store(0, memory_order_relaxed);
+    lock->spins.store(0, memory_order_relaxed);
+    pthread_mutex_init(&lock->mutex, nullptr);
+}
+
+static void lockDestroy(AreaLock* lock) {
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static bool lockTry(AreaLock* lock) {
+    if (mt_mutex_locks) return pthread_mutex_trylock(&lock->mutex) == 0;
+    int expected = 0;
+    return lock->state.compare_exchange_strong(expected, 1,
+                                               memory_order_acquire,
+                                               memory_order_relaxed);
+}
+
+// moves the spin estimate an eighth of the way to spins, with the lock held
+static void lockLearn(AreaLock* lock, int spins) {
+    int estimate = lock->spins.load(memory_order_relaxed);
+    lock->spins.store(estimate + (spins - estimate) / 8, memory_order_relaxed);
+}
+
+// the lock was taken when tried
+static void lockWait(AreaLock* lock) {
+    int limit = lock->spins.load(memory_order_relaxed) * 2 + AREA_SPIN_MIN;
+    if (limit > area_spin_max) limit = area_spin_max;
+
+    int pauses = 1;
+    for (int spin = 0; spin < limit; spin++) {
+        for (int i = 0; i < pauses; i++) cpuRelax();
+        if (pauses < AREA_BACKOFF_MAX) pauses *= 2;
+        if (lock->state.load(memory_order_relaxed) == 0 && lockTry(lock)) {
+            lockLearn(lock, spin);
+            return;
+        }
+    }
+
+    // mark the lock as having sleepers, whoever releases it wakes one
+    while (lock->state.exchange(2, memory_order_acquire) != 0) {
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, nullptr,
+                nullptr, 0);
+    }
+    lockLearn(lock, limit);
+}
+
+static void lockAcquire(AreaLock* lock) {
+    if (mt_mutex_locks) {
+        pthread_mutex_lock(&lock->mutex);
+    } else if (!lockTry(lock)) {
+        lockWait(lock);
+    }
+}
+
+static void lockRelease(AreaLock* lock) {
+    if (mt_mutex_locks) {
+        pthread_mutex_unlock(&lock->mutex);
+    } else if (lock->state.exchange(0, memory_order_release) == 2) {
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, nullptr,
+                nullptr, 0);
+    }
+}
+
+// areas are private mappings: the MemArea struct first, then one run of
+// blocks filling the rest of the mapping
+static size_t areaHeaderSize() {
+    return (sizeof(MemArea) + 15) & ~(size_t)15;
+}
+
+static MemArea* areaOf(Block* block) {
+    return area_table[block->area_id];
+}
+
+// maps length bytes, rounded up to whole huge pages, at a huge page boundary
+// so the kernel can back all of it with huge pages. without transparent huge
+// pages the advice fails and it stays an ordinary mapping.
+static void* mapHugePages(size_t& length) {
+    length = ALIGN_UP(length, HUGE_PAGE_SIZE);
+    size_t reserved = length + HUGE_PAGE_SIZE;
+    void* result = mmap(nullptr, reserved, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) return MAP_FAILED;
+
+    // cut off what lies outside the aligned range
+    char* raw = (char*)result;
+    char* aligned = (char*)ALIGN_UP((size_t)raw, HUGE_PAGE_SIZE);
+    if (aligned > raw) munmap(raw, aligned - raw);
+    size_t tail = raw + reserved - (aligned + length);
+    if (tail > 0) munmap(aligned + length, tail);
+
+    madvise(aligned, length, MADV_HUGEPAGE);
+    return aligned;
+}
+
+static MemArea* createArea(size_t size) {
+    size_t length = mappingSize(areaHeaderSize() + size);
+    if (length == 0 || next_area_id.load() >= MAX_AREAS) return nullptr;
+
+    void* mapping = mt_huge_pages
+                        ? mapHugePages(length)
+                        : mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return nullptr;
+
+    // ids are only used up by areas that exist, a failed mmap takes none
+    unsigned int id = next_area_id.fetch_add(1);
+    if (id >= MAX_AREAS) {
+        munmap(mapping, length);
+        return nullptr;
+    }
+
+    MemArea* new_area = (MemArea*)mapping;
+    new_area->size = length;
+    new_area->id = id;
+    lockInit(&new_area->area_lock);
+    area_table[id] = new_area;
+
+    // init first block in area, followed by the fence at the very end
+    Block* first_block = (Block*)((char*)mapping + areaHeaderSize());
+    first_block->size = length - areaHeaderSize() - 2 * sizeof(Block);
+    first_block->magic = blockMagic(first_block);
+    first_block->area_id = id;
+    writeFence(nextBlock(first_block), id);
+
+    new_area->rr_block_list = first_block;
+    memset(&new_area->bins, 0, sizeof(new_area->bins));
+    markFree(first_block);
+    binInsert(&new_area->bins, first_block);
+    new_area->next.store(nullptr, memory_order_relaxed);
+    new_area->remote_frees.store(nullptr, memory_order_relaxed);
+    new_area->lock_acquisitions = 0;
+    new_area->lock_contentions.store(0, memory_order_relaxed);
+    return new_area;
+}
+
+// links a new area after the tail. a thread that finds the tail lagging
+// behind a link made by another thread moves it forward and retries.
+static void publishArea(MemArea* new_area) {
+    while (true) {
+        MemArea* tail = area_tail.load(memory_order_acquire);
+        MemArea* next = nullptr;
+
+        if (tail->next.compare_exchange_weak(next, new_area,
+                                             memory_order_acq_rel)) {
+            area_tail.compare_exchange_strong(tail, new_area,
+                                              memory_order_acq_rel);
+            break;
+        }
+        if (next != nullptr) {
+            area_tail.compare_exchange_strong(tail, next, memory_order_acq_rel);
+        }
+    }
+    area_count.fetch_add(1, memory_order_release);
+}
+
+// size for the next on demand area, at least big enough for the request
+static size_t growAreaSize(size_t aligned_size) {
+    size_t area_size = next_area_size.load(memory_order_relaxed);
+    size_t grown;
+    do {
+        grown = (area_size * 2 < max_area_size) ? area_size * 2 : max_area_size;
+    } while (!next_area_size.compare_exchange_weak(area_size, grown,
+                                                   memory_order_relaxed));
+
+    if (area_size < aligned_size + sizeof(Block)) {
+        area_size = aligned_size + sizeof(Block);
+    }
+    return area_size;
+}
+
+void heapMTCreateEx(const HeapConfig* config) {
+    if (area_head.load() != nullptr) return;
+
+    HeapConfig defaults = { NUM_AREAS, AREA_SIZE, DEFAULT_MAX_AREA_SIZE, false,
+                            false, false, false };
+    if (config == nullptr) config = &defaults;
+
+    size_t num_areas = config->num_areas > 0 ? config->num_areas : 1;
+    mt_per_cpu = config->per_cpu_areas;
+    mt_huge_pages = config->huge_pages;
+    mt_mutex_locks = config->mutex_area_locks;
+    area_spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? AREA_SPIN_MAX : 0;
+    if (mt_per_cpu) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        num_cpu_areas = cpus > 0 ? cpus : 1;
+        if (num_cpu_areas > MAX_CPU_AREAS) num_cpu_areas = MAX_CPU_AREAS;
+        if (num_areas < num_cpu_areas) num_areas = num_cpu_areas;
+    }
+    size_t area_size = config->area_size > 0 ? config->area_size : AREA_SIZE;
+    max_area_size = config->max_area_size > area_size ? config->max_area_size
+                                                      : area_size;
+    next_area_size.store(area_size);
+    mt_deferred = config->deferred_coalescing;
+    slabHeapInit(&mt_slabs, true);
+
+    for (size_t i = 0; i < num_areas; i++) {
+        MemArea* new_area = createArea(area_size);
+        if (new_area == nullptr) break;
+        if (i < num_cpu_areas) cpu_areas[i].store(new_area);
+
+        // link areas
+        if (area_head.load() == nullptr) {
+            area_tail.store(new_area);
+            area_head.store(new_area);
+            area_count.fetch_add(1);
+        } else {
+            publishArea(new_area);
+        }
+    }
+}
+
+void heapMTCreate() {
+    heapMTCreateEx(nullptr);
+}
+
+void heapMTKill() {
+    if (area_head.load() == nullptr) return;
+    profileDropHeap(true);
+
+    MemArea* iter = area_head.load();
+    while (iter != nullptr) {
+        MemArea* next = iter->next.load();
+        lockDestroy(&iter->area_lock);
+        area_table[iter->id] = nullptr;
+        munmap(iter, iter->size);
+        iter = next;
+    }
+    next_area_id.store(1);
+    slabHeapDestroy(&mt_slabs);
+    mt_deferred = false;
+    mt_huge_pages = false;
+    mt_mutex_locks = false;
+    if (mt_per_cpu) {
+        for (size_t i = 0; i < num_cpu_areas; i++) cpu_areas[i].store(nullptr);
+        num_cpu_areas = 0;
+        mt_per_cpu = false;
+    }
+
+    area_head.store(nullptr);
+    area_tail.store(nullptr);
+    area_count.store(0);
+    mt_generation.fetch_add(1);
+}
+
+// area locks count how often they were taken and found taken
+static bool areaTryLock(MemArea* area) {
+    if (!lockTry(&area->area_lock)) {
+        area->lock_contentions.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    area->lock_acquisitions++;
+    return true;
+}
+
+static void areaLock(MemArea* area) {
+    if (!lockTry(&area->area_lock)) {
+        area->lock_contentions.fetch_add(1, memory_order_relaxed);
+        lockAcquire(&area->area_lock);
+    }
+    area->lock_acquisitions++;
+}
+
+static void areaUnlock(MemArea* area) {
+    lockRelease(&area->area_lock);
+}
+
+// link word at the start of a payload parked on a cache or remote list
+static void* &cacheNext(void* ptr) {
+    return *(void**)ptr;
+}
+
+// returns a block to its area, called with the area lock held
+static void areaReleaseBlock(Block* block) {
+    MemArea* area = areaOf(block);
+    char *from, *to;
+    unadvisedSpan(block, from, to);
+
+    // try to coalesce
+    tryCoalesce(block, &area->bins);
+    markFree(block);
+    binInsert(&area->bins, block);
+    if (blockSize(block) >= TRIM_INTERIOR_MIN) {
+        adviseFreeBlock(block, from, to);
+    }
+}
+
+// frees a block the user gave back, parking it in deferred mode. called with
+// the area lock held.
+static void areaFreeBlock(Block* block) {
+    MemArea* area = areaOf(block);
+    if (mt_deferred && quickPush(&area->bins, block)) {
+        if (area->bins.quick_count > QUICK_MAX_BLOCKS) {
+            quickFlush(&area->bins, areaReleaseBlock);
+        }
+        return;
+    }
+    areaReleaseBlock(block);
+}
+
+// a thread freeing a block of an area that is not its home does not wait for
+// the area lock. it pushes the block, still marked in use, on the area's
+// remote list and whoever next takes blocks from the area releases the list.
+static void remoteFree(MemArea* area, void* ptr) {
+    void* head = area->remote_frees.load(memory_order_relaxed);
+    do {
+        cacheNext(ptr) = head;
+    } while (!area->remote_frees.compare_exchange_weak(
+        head, ptr, memory_order_release, memory_order_relaxed));
+}
+
+// called with the area lock held
+static void areaDrainRemote(MemArea* area) {
+    if (area->remote_frees.load(memory_order_relaxed) == nullptr) return;
+
+    void* ptr = area->remote_frees.exchange(nullptr, memory_order_acquire);
+    while (ptr != nullptr) {
+        void* next = cacheNext(ptr);
+        areaFreeBlock(headerOf(ptr));
+        ptr = next;
+    }
+}
+
+// the best fitting free block of the area for aligned_size, off its list and
+// marked in use. called with the area lock held.
+static Block* areaTakeFit(MemArea* area, size_t aligned_size) {
+    Block* best_fit = findBestFit(&area->bins, aligned_size);
+    if (best_fit == nullptr && area->bins.quick_count > 0) {
+        quickFlush(&area->bins, areaReleaseBlock);
+        best_fit = findBestFit(&area->bins, aligned_size);
+    }
+    if (best_fit == nullptr) return nullptr;
+
+    binRemove(&area->bins, best_fit);
+    markUsed(best_fit);
+    return best_fit;
+}
+
+// cuts up to count blocks of aligned_size from the front of run, at least
+// one, and files what is left once. returns how many were cut.
+static size_t carveRun(Block* run, size_t aligned_size, void** out,
+                       size_t count, FreeBins* bins) {
+    size_t taken = 0;
+    while (taken < count && blockSize(run) >= aligned_size) {
+        if (blockSize(run) < aligned_size + sizeof(Block) + MIN_BLOCK_SIZE) {
+            out[taken++] = payloadOf(run); // too small to split, give it all
+            return taken;
+        }
+        splitBlock(run, aligned_size);
+        out[taken++] = payloadOf(run);
+        run = nextBlock(run);
+    }
+    markFree(run);
+    binInsert(bins, run);
+    return taken;
+}
+
+// takes a block of aligned_size out of the area, called with the area lock
+// held. returns the payload or nullptr if the area has no fitting block.
+static void *areaTakeBlock(MemArea* area, size_t aligned_size) {
+    Block* parked = quickPop(&area->bins, aligned_size);
+    if (parked != nullptr) return payloadOf(parked);
+
+    Block* best_fit = areaTakeFit(area, aligned_size);
+    if (best_fit == nullptr) return nullptr;
+
+    void* ptr;
+    carveRun(best_fit, aligned_size, &ptr, 1, &area->bins);
+    return ptr;
+}
+
+// takes up to count blocks under one hold of the area lock, after taking
+// back what other threads freed into the area. each free block found is cut
+// into as many of them as it holds.
+static size_t areaTakeBatch(MemArea* area, size_t aligned_size, void** out,
+                            size_t count) {
+    areaDrainRemote(area);
+    size_t taken = 0;
+    while (taken < count) {
+        Block* parked = quickPop(&area->bins, aligned_size);
+        if (parked != nullptr) {
+            out[taken++] = payloadOf(parked);
+            continue;
+        }
+
+        Block* run = areaTakeFit(area, aligned_size);
+        if (run == nullptr) break;
+        taken += carveRun(run, aligned_size, out + taken, count - taken,
+                          &area->bins);
+    }
+    return taken;
+}
+
+/*=============================================================================
+* per thread cache
+=============================================================================*/
+// freed small blocks and slab objects are kept, still marked in use, on per
+// thread stacks per 16 byte class, so a malloc/free pair of a cached size
+// never takes a lock. class c holds objects of at least c * 16 bytes.
+typedef struct ThreadCache {
+    void* heads[TCACHE_NUM_CLASSES];
+    unsigned int counts[TCACHE_NUM_CLASSES];
+    MemArea* home_area; // area this thread allocates from first
+    unsigned long generation;
+} ThreadCache;
+
+static thread_local ThreadCache tcache;
+static atomic<unsigned int> tcache_depth(TCACHE_DEFAULT_DEPTH);
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+void customMTSetCacheDepth(unsigned int depth) {
+    tcache_depth.store(depth, memory_order_relaxed);
+}
+
+static MemArea* homeArea();
+
+// gives up to count cached objects of class cls back to their slabs and
+// areas. blocks of the home area are released under one hold of its lock per
+// run, blocks of other areas go on their remote lists.
+static void tcacheFlush(size_t cls, unsigned int count) {
+    MemArea* locked = nullptr;
+    MemArea* home = homeArea();
+
+    while (count-- > 0 && tcache.heads[cls] != nullptr) {
+        void* ptr = tcache.heads[cls];
+        tcache.heads[cls] = cacheNext(ptr);
+        tcache.counts[cls]--;
+
+        if (isSlabPointer(&mt_slabs, ptr)) {
+            slabFree(&mt_slabs, ptr);
+            continue;
+        }
+
+        Block* block = headerOf(ptr);
+        if (areaOf(block) != home) {
+            remoteFree(areaOf(block), ptr);
+            continue;
+        }
+        if (areaOf(block) != locked) {
+            if (locked != nullptr) areaUnlock(locked);
+            locked = areaOf(block);
+            areaLock(locked);
+        }
+        areaFreeBlock(block);
+    }
+    if (locked != nullptr) areaUnlock(locked);
+}
+
+// pthread key destructor, runs when a thread that used the cache exits
+static void tcacheThreadExit(void*) {
+    if (tcache.generation != mt_generation.load()) return;
+    for (size_t cls = 0; cls < TCACHE_NUM_CLASSES; cls++) {
+        tcacheFlush(cls, tcache.counts[cls]);
+    }
+}
+
+static void tcacheCreateKey() {
+    pthread_key_create(&tcache_key, tcacheThreadExit);
+}
+
+// makes sure the cache belongs to the current heap, dropping anything cached
+// from a heap that was killed since
+static void tcacheSync() {
+    unsigned long generation = mt_generation.load(memory_order_acquire);
+    if (tcache.generation == generation) return;
+
+    memset(tcache.heads, 0, sizeof(tcache.heads));
+    memset(tcache.counts, 0, sizeof(tcache.counts));
+    tcache.home_area = nullptr;
+    tcache.generation = generation;
+
+    pthread_once(&tcache_key_once, tcacheCreateKey);
+    pthread_setspecific(tcache_key, &tcache);
+}
+
+static size_t mtTakeBlocks(size_t aligned_size, void** out, size_t count);
+
+// fills class cls with up to TCACHE_BATCH objects from its slabs, or blocks
+// from one area, under a single lock and returns one of them
+static void* tcacheRefill(size_t cls) {
+    void* batch[TCACHE_BATCH];
+    size_t taken = 0;
+    if (cls <= SLAB_NUM_CLASSES) {
+        taken = slabAllocBatch(&mt_slabs, cls - 1, batch, TCACHE_BATCH);
+    }
+    if (taken == 0) {
+        size_t aligned_size = alignedBlockSize(cls << 4);
+        taken = mtTakeBlocks(aligned_size, batch, TCACHE_BATCH);
+    }
+    if (taken == 0) return nullptr;
+
+    // pushed back to front so they come out in address order
+    for (size_t i = taken - 1; i > 0; i--) {
+        cacheNext(batch[i]) = tcache.heads[cls];
+        tcache.heads[cls] = batch[i];
+        tcache.counts[cls]++;
+    }
+    return batch[0];
+}
+
+static void* tcacheMalloc(size_t cls) {
+    if (cls >= TCACHE_NUM_CLASSES) return nullptr;
+
+    tcacheSync();
+    void* ptr = tcache.heads[cls];
+    if (ptr != nullptr) {
+        tcache.heads[cls] = cacheNext(ptr);
+        tcache.counts[cls]--;
+        return ptr;
+    }
+    return tcacheRefill(cls);
+}
+
+// returns false when the object does not go into the cache
+static bool tcacheFree(void* ptr, size_t size) {
+    size_t cls = size >> 4;
+    unsigned int depth = tcache_depth.load(memory_order_relaxed);
+    if (depth == 0 || cls >= TCACHE_NUM_CLASSES) return false;
+
+    tcacheSync();
+    cacheNext(ptr) = tcache.heads[cls];
+    tcache.heads[cls] = ptr;
+    tcache.counts[cls]++;
+
+    if (tcache.counts[cls] > depth) {
+        unsigned int batch = TCACHE_BATCH < depth ? TCACHE_BATCH : depth;
+        tcacheFlush(cls, tcache.counts[cls] - depth + batch);
+    }
+    return true;
+}
+
+/*=============================================================================
+* thread home areas
+=============================================================================*/
+// threads are spread over the areas on first use and keep allocating from
+// the same one, other areas are only visited when the home area is out of
+// space. in per CPU mode the home is the area of the CPU the thread runs on,
+// so threads on different CPUs do not share a lock.
+static atomic<MemArea*>& cpuArea() {
+    int cpu = sched_getcpu();
+    return cpu_areas[(cpu > 0 ? cpu : 0) % num_cpu_areas];
+}
+
+static MemArea* homeArea() {
+    if (mt_per_cpu) return cpuArea().load(memory_order_relaxed);
+
+    tcacheSync();
+    if (tcache.home_area == nullptr) {
+        size_t index = next_home.fetch_add(1) % area_count.load();
+        MemArea* area = area_head.load(memory_order_acquire);
+        while (index-- > 0) area = area->next.load(memory_order_acquire);
+        tcache.home_area = area;
+    }
+    return tcache.home_area;
+}
+
+// the thread moves to an area it stole from. a CPU keeps its own area,
+// pointing it at another CPU's would have both CPUs share one lock.
+static void moveHome(MemArea* area) {
+    if (!mt_per_cpu) tcache.home_area = area;
+}
+
+// the thread, or its CPU, moves to an area it just added, nobody else
+// allocates from that one yet
+static void adoptArea(MemArea* area) {
+    if (mt_per_cpu) {
+        cpuArea().store(area, memory_order_relaxed);
+    } else {
+        tcache.home_area = area;
+    }
+}
+
+static MemArea* nextArea(MemArea* area) {
+    MemArea* next = area->next.load(memory_order_acquire);
+    return (next != nullptr) ? next : area_head.load(memory_order_acquire);
+}
+
+// takes up to count blocks from the first area that has any: the home area,
+// then every area whose lock is free, then every area waiting for its lock.
+// a thread that steals successfully adopts that area as its new home, a CPU
+// in per CPU mode does not.
+static size_t mtTakeBlocks(size_t aligned_size, void** out, size_t count) {
+    MemArea* home = homeArea();
+
+    areaLock(home);
+    size_t taken = areaTakeBatch(home, aligned_size, out, count);
+    areaUnlock(home);
+    if (taken > 0) return taken;
+
+    // steal from areas nobody is holding
+    bool skipped = false;
+    for (MemArea* iter = nextArea(home); iter != home; iter = nextArea(iter)) {
+        if (!areaTryLock(iter)) {
+            skipped = true;
+            continue;
+        }
+        taken = areaTakeBatch(iter, aligned_size, out, count);
+        areaUnlock(iter);
+        if (taken > 0) {
+            moveHome(iter); // the thread moves to where space is
+            return taken;
+        }
+    }
+    if (!skipped) return 0;
+
+    // some areas were busy, wait for their locks
+    for (MemArea* iter = nextArea(home); iter != home; iter = nextArea(iter)) {
+        areaLock(iter);
+        taken = areaTakeBatch(iter, aligned_size, out, count);
+        areaUnlock(iter);
+        if (taken > 0) {
+            moveHome(iter);
+            return taken;
+        }
+    }
+    return 0;
+}
+
+/*=============================================================================
+* MT allocation
+=============================================================================*/
+static void* mtAreaMalloc(size_t aligned_size);
+
+static void* mtMalloc(size_t size) {
+    if (size == 0 || tooLarge(size)) return nullptr;
+    size_t aligned_size = alignedBlockSize(size);
+    int slab_class = slabClass(size);
+
+    if (tcache_depth.load(memory_order_relaxed) > 0) {
+        size_t cls = slab_class >= 0 ? slab_class + 1 : (aligned_size + 15) >> 4;
+        void* cached = tcacheMalloc(cls);
+        if (cached != nullptr) return cached;
+    }
+
+    // small objects from the shared slabs
+    if (slab_class >= 0) {
+        void* object = slabAlloc(&mt_slabs, slab_class);
+        if (object != nullptr) return object;
+    }
+
+    // large requests get their own mapping
+    if (is_large_request(aligned_size)) {
+        Block* large = mmapBlock(aligned_size);
+        return large == nullptr ? nullptr : payloadOf(large);
+    }
+
+    return mtAreaMalloc(aligned_size);
+}
+
+void *customMTMalloc(size_t size) {
+    void* ptr = mtMalloc(size);
+    profileTick(ptr, size, true);
+    return ptr;
+}
+
+// adds an area with room for at least bytes. areas grow geometrically, or to
+// the request if that is bigger. the thread that grew the heap moves there.
+static MemArea* addArea(size_t bytes) {
+    MemArea* new_area = createArea(growAreaSize(bytes));
+    if (new_area == nullptr) return nullptr;
+
+    // link to the end of the area list
+    publishArea(new_area);
+    adoptArea(new_area);
+    return new_area;
+}
+
+// takes a block from the areas, adding an area if none of them has room
+static void* mtAreaMalloc(size_t aligned_size) {
+    void* ptr = nullptr;
+    size_t seen_areas;
+    do {
+        seen_areas = area_count.load(memory_order_acquire);
+        if (mtTakeBlocks(aligned_size, &ptr, 1) > 0) return ptr;
+        // retry if another thread published an area during the search
+    } while (seen_areas != area_count.load(memory_order_acquire));
+
+    // block wasn't found, need to allocate a new area
+    MemArea* new_area = addArea(aligned_size);
+    if (new_area == nullptr) return nullptr;
+
+    // now we can allocate from the new area
+    areaLock(new_area);
+    void* final_res = areaTakeBlock(new_area, aligned_size);
+    areaUnlock(new_area);
+
+    return final_res; // nullptr shouldn't happen (fail-safe)
+}
+
+// frees a block of an area or a mapping
+static void mtFreeBlock(Block* block) {
+    if (isMmapped(block)) {
+        munmapBlock(block);
+        return;
+    }
+    if (tcacheFree(payloadOf(block), blockSize(block))) return;
+
+    MemArea* area = areaOf(block);
+    if (area == homeArea()) {
+        areaLock(area);
+    } else if (!areaTryLock(area)) {
+        // another thread is working in the area, leave the block to it
+        remoteFree(area, payloadOf(block));
+        return;
+    }
+    areaFreeBlock(block);
+    areaUnlock(area);
+}
+
+void customMTFree(void *ptr) {
+    if (ptr == nullptr) return;
+    profileForget(ptr);
+
+    if (isSlabPointer(&mt_slabs, ptr)) {
+        Slab* slab = slabOf(ptr);
+        if (slab->magic == SLAB_MAGIC && tcacheFree(ptr, slab->object_size)) {
+            return;
+        }
+        slabFree(&mt_slabs, ptr);
+        return;
+    }
+
+    mtFreeBlock(headerOf(ptr));
+}
+
+void customMTFreeSized(void *ptr, size_t size) {
+    if (ptr == nullptr) return;
+    assert(sizedFreeMatches(&mt_slabs, ptr, size));
+    profileForget(ptr);
+
+    // the thread cache class comes from the size, the slab header is only
+    // read when the cache is full and slabFree takes the object back
+    int slab_class = slabClass(size);
+    if (slab_class >= 0 && isSlabPointer(&mt_slabs, ptr)) {
+        if (tcacheFree(ptr, (slab_class + 1) * 16)) return;
+        slabFree(&mt_slabs, ptr);
+        return;
+    }
+    mtFreeBlock(headerOf(ptr));
+}
+
+static size_t mtMallocBatch(size_t size, size_t count, void** out) {
+    if (size == 0 || tooLarge(size)) return 0;
+    size_t aligned_size = alignedBlockSize(size);
+    size_t done = 0;
+
+    // small objects under one hold of their class lock
+    int slab_class = slabClass(size);
+    if (slab_class >= 0) {
+        done = slabAllocBatch(&mt_slabs, slab_class, out, count);
+    }
+
+    if (is_large_request(aligned_size)) {
+        for (; done < count; done++) {
+            Block* large = mmapBlock(aligned_size);
+            if (large == nullptr) break;
+            out[done] = payloadOf(large);
+        }
+        return done;
+    }
+
+    // runs of blocks from one area per lock hold, a new area sized for all
+    // that is missing when none has room
+    while (done < count) {
+        size_t taken = mtTakeBlocks(aligned_size, out + done, count - done);
+        if (taken == 0) {
+            size_t per_block = aligned_size + sizeof(Block);
+            if (count - done > (size_t)PTRDIFF_MAX / per_block) break;
+            size_t missing = (count - done) * per_block;
+            if (addArea(missing) == nullptr) break;
+        }
+        done += taken;
+    }
+    return done;
+}
+
+size_t customMTMallocBatch(size_t size, size_t count, void** out) {
+    size_t done = mtMallocBatch(size, count, out);
+    for (size_t i = 0; i < done; i++) profileTick(out[i], size, true);
+    return done;
+}
+
+void customMTFreeBatch(void** ptrs, size_t count) {
+    MemArea* locked = nullptr;
+
+    // before any area lock, the profile lock is never taken inside one
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i] != nullptr) profileForget(ptrs[i]);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        void* ptr = ptrs[i];
+        if (ptr == nullptr) continue;
+
+        if (isSlabPointer(&mt_slabs, ptr)) {
+            slabFree(&mt_slabs, ptr);
+            continue;
+        }
+        Block* block = headerOf(ptr);
+        if (isMmapped(block)) {
+            munmapBlock(block);
+            continue;
+        }
+
+        // one hold of the lock for each run of blocks from the same area
+        if (areaOf(block) != locked) {
+            if (locked != nullptr) areaUnlock(locked);
+            locked = areaOf(block);
+            areaLock(locked);
+        }
+        areaFreeBlock(block);
+    }
+    if (locked != nullptr) areaUnlock(locked);
+}
+
+int customMTTrim() {
+    bool released = false;
+    for (MemArea* area = area_head.load(memory_order_acquire); area != nullptr;
+         area = area->next.load(memory_order_acquire)) {
+        areaLock(area);
+        areaDrainRemote(area);
+        quickFlush(&area->bins, areaReleaseBlock);
+        released |= adviseAllFreeBlocks(&area->bins);
+        areaUnlock(area);
+    }
+    return released;
+}
+
+size_t customMTUsableSize(void *ptr) {
+    if (ptr == nullptr) return 0;
+    if (isSlabPointer(&mt_slabs, ptr)) return slabObjectSize(ptr);
+    return blockSize(headerOf(ptr));
+}
+
+void *customMTCalloc(size_t nmemb, size_t size) {
+    size_t total_size;
+    if (__builtin_mul_overflow(nmemb, size, &total_size)) return nullptr;
+
+    void* ptr = customMTMalloc(total_size);
+    if (ptr == nullptr) return nullptr;
+
+    // a fresh mapping is zero already. area blocks may be reused, and a
+    // new area's blocks carry free list links from before they were split.
+    if (isSlabPointer(&mt_slabs, ptr) || !isMmapped(headerOf(ptr))) {
+        memset(ptr, 0, total_size);
     }
     return ptr;
 }
 
 // helper function for realloc, called when locks are held
 void shrinking_block_split_mt(Block *block, size_t new_size) {
-    if (block->size >= new_size + sizeof(Block) + 4) {
+    if (blockSize(block) >= new_size + sizeof(Block) + MIN_BLOCK_SIZE) {
       splitBlock(block, new_size);
-      Block *remainder = block->next;
+      Block *remainder = nextBlock(block);
 
-      remainder->lock = block->lock;
-      remainder->is_free = true;
-      tryCoalesce(remainder);
+      areaReleaseBlock(remainder);
     }
 }
 
-void *customMTRealloc(void *ptr, size_t size) {
-    if (ptr == nullptr) return customMTMalloc(size);
+static void* mtAlignedAlloc(size_t alignment, size_t size) {
+    if (size == 0 || tooLarge(size) || tooLarge(alignment) ||
+        tooLarge(size + alignment) || alignment == 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return nullptr;
+    }
+    if (alignment <= CUSTOM_ALIGNMENT) return mtMalloc(size);
+
+    size_t aligned_size = alignedBlockSize(size);
+    void* ptr = mtAreaMalloc(aligned_size + alignedPadding(alignment));
+    if (ptr == nullptr) return nullptr;
+
+    Block* block = headerOf(ptr);
+    MemArea* area = areaOf(block);
+    areaLock(area);
+    block = carveAligned(block, alignment, areaReleaseBlock);
+    shrinking_block_split_mt(block, aligned_size);
+    areaUnlock(area);
+    return payloadOf(block);
+}
+
+void *customMTAlignedAlloc(size_t alignment, size_t size) {
+    void* ptr = mtAlignedAlloc(alignment, size);
+    profileTick(ptr, size, true);
+    return ptr;
+}
+
+static void* mtRealloc(void* ptr, size_t size) {
+    if (ptr == nullptr) return mtMalloc(size);
     if (size == 0) {
         customMTFree(ptr);
         return nullptr;
     }
+    if (tooLarge(size)) return nullptr; // the old block is untouched
 
-    Block* block = (Block*)((char*)ptr - sizeof(Block));
-    size_t new_aligned_size = ALIGN_TO_MULT_OF_4(size);
-    
-    if (block->lock) pthread_mutex_lock(block->lock);
+    // a slab object stays if it still fits, otherwise it moves out
+    if (isSlabPointer(&mt_slabs, ptr)) {
+        size_t object_size = slabObjectSize(ptr);
+        if (size <= object_size) return ptr;
+
+        void* new_ptr = mtMalloc(size);
+        if (new_ptr == nullptr) return nullptr;
+        memcpy(new_ptr, ptr, object_size);
+        customMTFree(ptr);
+        return new_ptr;
+    }
+
+    Block* block = headerOf(ptr);
+    size_t new_aligned_size = alignedBlockSize(size);
+
+    if (isMmapped(block)) {
+        Block* moved = mremapBlock(block, new_aligned_size);
+        return moved == nullptr ? nullptr : payloadOf(moved);
+    }
 
-    size_t old_size = block->size;
+    // every block that is neither a slab object nor mapped has an area
+    MemArea* area = areaOf(block);
+    assert(area != nullptr);
+    areaLock(area);
+
+    size_t old_size = blockSize(block);
 
     // in case of shrinking or same size
     if (new_aligned_size <= old_size) {
         shrinking_block_split_mt(block, new_aligned_size);
-        if (block->lock) pthread_mutex_unlock(block->lock);
+        areaUnlock(area);
         return ptr;
     }
 
-    // expanding in place
-    if (block->next != nullptr && block->next->is_free &&
-        (block->size + sizeof(Block) + block->next->size) >= new_aligned_size) {
-        
-        Block *next_block = block->next;
-        size_t combined_size = block->size + sizeof(Block) + next_block->size;
-
-        // "merge free blocks"
-        block->size = combined_size;
-        block->next = next_block->next;
-        if (next_block->next != nullptr){
-          next_block->next->prev = block;
-        }
-
+    // expanding in place into the next block
+    Block *next_block = nextBlock(block);
+    if (isFree(next_block) &&
+        (old_size + sizeof(Block) + blockSize(next_block)) >= new_aligned_size) {
+        absorbNext(block, &area->bins);
         shrinking_block_split_mt(block, new_aligned_size);
 
-        if (block->lock) pthread_mutex_unlock(block->lock);
+        areaUnlock(area);
         return ptr;
     }
 
-    // expand by moving 
-    if (block->lock) pthread_mutex_unlock(block->lock);
+    // or into both neighbours, moving the payload down
+    Block* grown = growIntoNeighbours(block, new_aligned_size, &area->bins);
+    if (grown != nullptr) {
+        shrinking_block_split_mt(grown, new_aligned_size);
+        areaUnlock(area);
+        return payloadOf(grown);
+    }
+
+    // expand by moving
+    areaUnlock(area);
     
-    void* new_ptr = customMTMalloc(size);
+    void* new_ptr = mtMalloc(size);
     if (new_ptr == nullptr) return nullptr; // allocation failed
 
     // copy old data
@@ -577,3 +2673,535 @@ void *customMTRealloc(void *ptr, size_t size) {
 
     return new_ptr;
 }
+
+// a resize counts as a free of ptr and a malloc of what it returns
+void *customMTRealloc(void *ptr, size_t size) {
+    if (ptr != nullptr) profileForget(ptr);
+    void* moved = mtRealloc(ptr, size);
+    profileTick(moved, size, true);
+    return moved;
+}
+
+/*=============================================================================
+* fork
+=============================================================================*/
+// locks are taken in the order the heap nests them: the profile lock, an
+// area, then a slab class, then the slab pool. the profile lock is only ever
+// taken with none of the others held, the mapping registry lock with none
+// taken after it.
+// only the areas that were there in prepare are unlocked again, the list
+// only grows at the tail.
+static size_t fork_locked_areas = 0;
+
+void heapMTForkPrepare() {
+    pthread_mutex_lock(&profile_lock);
+    fork_locked_areas = 0;
+    for (MemArea* area = area_head.load(memory_order_acquire); area != nullptr;
+         area = area->next.load(memory_order_acquire)) {
+        lockAcquire(&area->area_lock);
+        fork_locked_areas++;
+    }
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_lock(&mt_slabs.class_locks[i]);
+    }
+    pthread_mutex_lock(&mt_slabs.pool_lock);
+    pthread_mutex_lock(&mapping_lock);
+}
+
+void heapMTForkParent() {
+    pthread_mutex_unlock(&mapping_lock);
+    pthread_mutex_unlock(&mt_slabs.pool_lock);
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_unlock(&mt_slabs.class_locks[i]);
+    }
+    MemArea* area = area_head.load(memory_order_acquire);
+    for (size_t i = 0; i < fork_locked_areas; i++) {
+        areaUnlock(area);
+        area = area->next.load(memory_order_acquire);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// the child has only the forking thread, so every lock starts over, including
+// those of an area another thread published and locked after prepare
+void heapMTForkChild() {
+    pthread_mutex_init(&profile_lock, nullptr);
+    pthread_mutex_init(&mapping_lock, nullptr);
+    pthread_mutex_init(&mt_slabs.pool_lock, nullptr);
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_init(&mt_slabs.class_locks[i], nullptr);
+    }
+    for (MemArea* area = area_head.load(memory_order_acquire); area != nullptr;
+         area = area->next.load(memory_order_acquire)) {
+        lockInit(&area->area_lock);
+    }
+}
+
+/*=============================================================================
+* statistics
+=============================================================================*/
+// smallest block size filed in class cls, the inverse of sizeClass
+static size_t classMinSize(size_t cls) {
+    if (cls < (SMALL_CLASS_LIMIT >> 4)) return cls << 4;
+
+    size_t step = cls - (SMALL_CLASS_LIMIT >> 4);
+    int msb = SMALL_CLASS_SHIFT + step / CLASS_SUBDIVISIONS;
+    return ((size_t)1 << msb) +
+           (step % CLASS_SUBDIVISIONS) * ((size_t)1 << (msb - 2));
+}
+
+// adds the blocks from first up to the fence to stats and area, either of
+// which may be nullptr
+static void walkBlocks(Block* first, MallocStats* stats, AreaStats* area) {
+    MallocStats scratch;
+    if (stats == nullptr) {
+        memset(&scratch, 0, sizeof(scratch));
+        stats = &scratch;
+    }
+
+    for (Block* block = first;; block = nextBlock(block)) {
+        stats->header_bytes += sizeof(Block);
+        size_t size = blockSize(block);
+        if (size == 0) break; // fence
+
+        ClassStats* cls = &stats->classes[sizeClass(size)];
+        if (isFree(block)) {
+            stats->free_blocks++;
+            stats->free_bytes += size;
+            cls->free_blocks++;
+            cls->free_bytes += size;
+            if (size > stats->largest_free) stats->largest_free = size;
+            if (area != nullptr) {
+                area->free_blocks++;
+                area->free_bytes += size;
+                if (size > area->largest_free) area->largest_free = size;
+            }
+        } else if (block->magic == blockMagic(block)) {
+            stats->live_blocks++;
+            stats->live_bytes += size;
+            cls->live_blocks++;
+            cls->live_bytes += size;
+            if (area != nullptr) {
+                area->live_blocks++;
+                area->live_bytes += size;
+            }
+        } else {
+            stats->held_blocks++;
+            stats->held_bytes += size;
+        }
+    }
+}
+
+static void walkSlabs(SlabHeap* heap, MallocStats* stats) {
+    if (heap->base == nullptr) return;
+
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slabLock(heap, &heap->class_locks[i]);
+    }
+    for (char* page = heap->base; page < heap->unused; page += SLAB_SIZE) {
+        Slab* slab = (Slab*)page;
+        if (slab->magic != SLAB_MAGIC) {
+            stats->empty_slabs++;
+            continue;
+        }
+        SlabStats* cls = &stats->slab_classes[slab->object_size / 16 - 1];
+        cls->slabs++;
+        cls->live_objects += slab->capacity - slab->free_count;
+        cls->free_objects += slab->free_count;
+    }
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slabUnlock(heap, &heap->class_locks[i]);
+    }
+}
+
+static void largeStats(MallocStats* stats) {
+    stats->large_blocks = large_blocks.load(memory_order_relaxed);
+    stats->large_bytes = large_bytes.load(memory_order_relaxed);
+    stats->mmap_calls = mmap_calls.load(memory_order_relaxed);
+}
+
+void customMallocStats(MallocStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (block_list != nullptr) {
+        stats->heap_bytes =
+            (char*)st_fence + sizeof(Block) - (char*)block_list;
+        walkBlocks(block_list, stats, nullptr);
+    }
+    if (st_slabs_ready) walkSlabs(&st_slabs, stats);
+    stats->sbrk_calls = st_sbrk_calls;
+    largeStats(stats);
+}
+
+// walks one area under its lock. taking the lock directly keeps the reader
+// out of the area's own lock counters.
+static void collectArea(MemArea* area, MallocStats* stats, AreaStats* out) {
+    memset(out, 0, sizeof(*out));
+    lockAcquire(&area->area_lock);
+    out->id = area->id;
+    out->size = area->size;
+    out->lock_acquisitions = area->lock_acquisitions;
+    out->lock_contentions = area->lock_contentions.load(memory_order_relaxed);
+    walkBlocks((Block*)((char*)area + areaHeaderSize()), stats, out);
+    areaUnlock(area);
+}
+
+size_t customMTMallocStats(MallocStats* stats, AreaStats* areas,
+                           size_t max_areas) {
+    memset(stats, 0, sizeof(*stats));
+    for (MemArea* area = area_head.load(memory_order_acquire); area != nullptr;
+         area = area->next.load(memory_order_acquire)) {
+        AreaStats area_stats;
+        collectArea(area, stats, &area_stats);
+        if (areas != nullptr && stats->num_areas < max_areas) {
+            areas[stats->num_areas] = area_stats;
+        }
+        stats->num_areas++;
+        stats->heap_bytes += area_stats.size;
+        stats->lock_acquisitions += area_stats.lock_acquisitions;
+        stats->lock_contentions += area_stats.lock_contentions;
+    }
+    walkSlabs(&mt_slabs, stats);
+    largeStats(stats);
+    return stats->num_areas;
+}
+
+// the dump formats into a fixed buffer and writes it out when it fills up
+typedef struct StatsWriter {
+    int fd;
+    bool json;
+    size_t len;
+    char buf[2048];
+} StatsWriter;
+
+typedef struct StatField {
+    const char* name;
+    size_t value;
+} StatField;
+
+static void statsFlush(StatsWriter* out) {
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    out->len = 0;
+}
+
+static void statsPrint(StatsWriter* out, const char* format, ...) {
+    if (out->len > sizeof(out->buf) / 2) statsFlush(out);
+
+    va_list args;
+    va_start(args, format);
+    size_t room = sizeof(out->buf) - out->len;
+    int n = vsnprintf(out->buf + out->len, room, format, args);
+    va_end(args);
+    if (n > 0) out->len += (size_t)n < room ? (size_t)n : room - 1;
+}
+
+// one record: "name value" pairs on a line, or a JSON object
+static void statsRecord(StatsWriter* out, const char* title,
+                        const StatField* fields, size_t count, bool last) {
+    if (out->json) {
+        statsPrint(out, "    {");
+        for (size_t i = 0; i < count; i++) {
+            statsPrint(out, "%s\"%s\": %zu", i ? ", " : "", fields[i].name,
+                       fields[i].value);
+        }
+        statsPrint(out, last ? "}\n" : "},\n");
+    } else {
+        statsPrint(out, "%s", title);
+        for (size_t i = 0; i < count; i++) {
+            statsPrint(out, " %s %zu", fields[i].name, fields[i].value);
+        }
+        statsPrint(out, "\n");
+    }
+}
+
+// totals, then one record per non empty class. MT dumps follow with areas.
+static void dumpStats(StatsWriter* out, const MallocStats* stats) {
+    StatField totals[] = {
+        { "heap_bytes", stats->heap_bytes },
+        { "live_blocks", stats->live_blocks },
+        { "live_bytes", stats->live_bytes },
+        { "free_blocks", stats->free_blocks },
+        { "free_bytes", stats->free_bytes },
+        { "largest_free", stats->largest_free },
+        { "fragmented_bytes", stats->free_bytes - stats->largest_free },
+        { "held_blocks", stats->held_blocks },
+        { "held_bytes", stats->held_bytes },
+        { "header_bytes", stats->header_bytes },
+        { "empty_slabs", stats->empty_slabs },
+        { "num_areas", stats->num_areas },
+        { "lock_acquisitions", stats->lock_acquisitions },
+        { "lock_contentions", stats->lock_contentions },
+        { "sbrk_calls", stats->sbrk_calls },
+        { "large_blocks", stats->large_blocks },
+        { "large_bytes", stats->large_bytes },
+        { "mmap_calls", stats->mmap_calls },
+    };
+    size_t count = sizeof(totals) / sizeof(totals[0]);
+
+    if (out->json) {
+        statsPrint(out, "{\n");
+        for (size_t i = 0; i < count; i++) {
+            statsPrint(out, "  \"%s\": %zu,\n", totals[i].name,
+                       totals[i].value);
+        }
+        statsPrint(out, "  \"slab_classes\": [\n");
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            statsPrint(out, "%s: %zu\n", totals[i].name, totals[i].value);
+        }
+    }
+
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+        const SlabStats* slab = &stats->slab_classes[i];
+        StatField fields[] = {
+            { "object_size", (i + 1) * 16 },
+            { "slabs", slab->slabs },
+            { "live_objects", slab->live_objects },
+            { "free_objects", slab->free_objects },
+        };
+        statsRecord(out, "slab class", fields, 4, i == SLAB_NUM_CLASSES - 1);
+    }
+
+    size_t last = 0;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        const ClassStats* cls = &stats->classes[i];
+        if (cls->live_blocks + cls->free_blocks > 0) last = i;
+    }
+    if (out->json) statsPrint(out, "  ],\n  \"classes\": [\n");
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        const ClassStats* cls = &stats->classes[i];
+        if (cls->live_blocks + cls->free_blocks == 0) continue;
+        StatField fields[] = {
+            { "min_size", classMinSize(i) },
+            { "live_blocks", cls->live_blocks },
+            { "live_bytes", cls->live_bytes },
+            { "free_blocks", cls->free_blocks },
+            { "free_bytes", cls->free_bytes },
+        };
+        statsRecord(out, "class", fields, 5, i == last);
+    }
+    if (out->json) statsPrint(out, "  ]");
+}
+
+void customMallocStatsDump(int fd, bool json) {
+    MallocStats stats;
+    customMallocStats(&stats);
+
+    StatsWriter out;
+    out.fd = fd;
+    out.json = json;
+    out.len = 0;
+    dumpStats(&out, &stats);
+    if (json) statsPrint(&out, "\n}\n");
+    statsFlush(&out);
+}
+
+void customMTMallocStatsDump(int fd, bool json) {
+    MallocStats stats;
+    customMTMallocStats(&stats, nullptr, 0);
+
+    StatsWriter out;
+    out.fd = fd;
+    out.json = json;
+    out.len = 0;
+    dumpStats(&out, &stats);
+
+    if (json) statsPrint(&out, ",\n  \"areas\": [\n");
+    for (MemArea* area = area_head.load(memory_order_acquire); area != nullptr;
+         area = area->next.load(memory_order_acquire)) {
+        AreaStats area_stats;
+        collectArea(area, nullptr, &area_stats);
+        StatField fields[] = {
+            { "id", area_stats.id },
+            { "size", area_stats.size },
+            { "live_blocks", area_stats.live_blocks },
+            { "live_bytes", area_stats.live_bytes },
+            { "free_blocks", area_stats.free_blocks },
+            { "free_bytes", area_stats.free_bytes },
+            { "largest_free", area_stats.largest_free },
+            { "lock_acquisitions", area_stats.lock_acquisitions },
+            { "lock_contentions", area_stats.lock_contentions },
+        };
+        bool last = area->next.load(memory_order_acquire) == nullptr;
+        statsRecord(&out, "area", fields, 9, last);
+    }
+    if (json) statsPrint(&out, "  ]\n}\n");
+    statsFlush(&out);
+}
+
+
+// a sample of size bytes stands for this many live bytes: the chance that
+// an object got sampled is 1 - exp(-size / rate)
+static size_t profileEstimate(size_t size, size_t rate) {
+    return (size_t)(size / (1.0 - exp(-(double)size / rate)));
+}
+
+static void copyFile(StatsWriter* out, const char* path) {
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return;
+    statsFlush(out);
+    ssize_t n;
+    while ((n = read(in, out->buf, sizeof(out->buf))) > 0) {
+        out->len = n;
+        statsFlush(out);
+    }
+    close(in);
+}
+
+// pprof reads the heap_v2 header as the sampling rate and scales the samples
+// back up itself. the text dump does the same and symbolises the stacks.
+void customHeapProfileDump(int fd, bool pprof) {
+    StatsWriter out;
+    out.fd = fd;
+    out.json = false;
+    out.len = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    size_t rate = profile_last_rate;
+    size_t count = 0, bytes = 0, estimated = 0;
+    for (size_t slot = 0; profile_keys != nullptr && slot < PROFILE_TABLE_SIZE;
+         slot++) {
+        if (profile_keys[slot].load(memory_order_relaxed) <= PROFILE_REMOVED) {
+            continue;
+        }
+        count++;
+        const ProfileSample* sample = &profile_samples[profile_index[slot]];
+        bytes += sample->size;
+        estimated += profileEstimate(sample->size, rate);
+    }
+
+    if (pprof) {
+        statsPrint(&out, "heap profile: %zu: %zu [ %zu: %zu] @ heap_v2/%zu\n",
+                   count, bytes, count, bytes, rate);
+    } else {
+        statsPrint(&out, "sampled_objects: %zu\nsampled_bytes: %zu\n"
+                   "estimated_live_bytes: %zu\nsample_rate: %zu\n",
+                   count, bytes, estimated, rate);
+    }
+
+    for (size_t slot = 0; count > 0 && slot < PROFILE_TABLE_SIZE; slot++) {
+        if (profile_keys[slot].load(memory_order_relaxed) <= PROFILE_REMOVED) {
+            continue;
+        }
+        const ProfileSample* sample = &profile_samples[profile_index[slot]];
+        if (pprof) {
+            statsPrint(&out, "1: %zu [ 1: %zu] @", sample->size, sample->size);
+            for (int i = 0; i < sample->depth; i++) {
+                statsPrint(&out, " 0x%zx", (size_t)sample->frames[i]);
+            }
+            statsPrint(&out, "\n");
+        } else {
+            statsPrint(&out, "\n%zu bytes, about %zu live, allocated at:\n",
+                       sample->size, profileEstimate(sample->size, rate));
+            statsFlush(&out);
+            backtrace_symbols_fd(sample->frames, sample->depth, fd);
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    // pprof maps the addresses to binaries with these
+    if (pprof) {
+        statsPrint(&out, "\nMAPPED_LIBRARIES:\n");
+        copyFile(&out, "/proc/self/maps");
+    }
+    statsFlush(&out);
+}
+
+/*=============================================================================
+* regions
+=============================================================================*/
+static size_t regionHeaderSize() {
+    return ALIGN_UP(sizeof(RegionChunk), CUSTOM_ALIGNMENT);
+}
+
+static void* regionHeapMalloc(Region* region, size_t size) {
+    return region->mt ? customMTMalloc(size) : customMalloc(size);
+}
+
+static void regionHeapFree(Region* region, void* ptr) {
+    if (region->mt) {
+        customMTFree(ptr);
+    } else {
+        customFree(ptr);
+    }
+}
+
+static void regionEnter(Region* region, RegionChunk* chunk) {
+    region->current = chunk;
+    region->cursor = (char*)chunk + regionHeaderSize();
+    region->limit = region->cursor + chunk->size;
+}
+
+// moves on to the next chunk with room for size. if none has, a new chunk
+// goes right after the current one, so the chunks it skips stay in line for
+// later requests.
+static bool regionGrow(Region* region, size_t size) {
+    RegionChunk* chunk = region->current != nullptr ? region->current->next
+                                                    : region->first;
+    while (chunk != nullptr && chunk->size < size) chunk = chunk->next;
+
+    if (chunk == nullptr) {
+        size_t bytes = size > region->chunk_size ? size : region->chunk_size;
+        chunk = (RegionChunk*)regionHeapMalloc(region,
+                                               regionHeaderSize() + bytes);
+        if (chunk == nullptr) return false;
+        chunk->size = bytes;
+
+        if (region->current != nullptr) {
+            chunk->next = region->current->next;
+            region->current->next = chunk;
+        } else {
+            chunk->next = region->first;
+            region->first = chunk;
+        }
+    }
+    regionEnter(region, chunk);
+    return true;
+}
+
+Region* regionCreate(size_t chunk_size, bool mt) {
+    if (tooLarge(chunk_size)) return nullptr;
+    Region* region = (Region*)(mt ? customMTMalloc(sizeof(Region))
+                                  : customMalloc(sizeof(Region)));
+    if (region == nullptr) return nullptr;
+
+    region->first = nullptr;
+    region->current = nullptr;
+    region->cursor = nullptr;
+    region->limit = nullptr;
+    region->chunk_size = chunk_size > 0 ? ALIGN_UP(chunk_size, CUSTOM_ALIGNMENT)
+                                        : REGION_DEFAULT_CHUNK;
+    region->mt = mt;
+    return region;
+}
+
+void* regionAlloc(Region* region, size_t size) {
+    if (size == 0 || tooLarge(size)) return nullptr; // before it can wrap
+    size = ALIGN_UP(size, CUSTOM_ALIGNMENT);
+
+    if ((size_t)(region->limit - region->cursor) < size &&
+        !regionGrow(region, size)) {
+        return nullptr;
+    }
+    void* ptr = region->cursor;
+    region->cursor += size;
+    return ptr;
+}
+
+void regionReset(Region* region) {
+    if (region->first != nullptr) regionEnter(region, region->first);
+}
+
+void regionDestroy(Region* region) {
+    RegionChunk* chunk = region->first;
+    while (chunk != nullptr) {
+        RegionChunk* next = chunk->next;
+        regionHeapFree(region, chunk);
+        chunk = next;
+    }
+    regionHeapFree(region, region);
+}
@@ -28,34 +28,324 @@ void heapKill();
 =============================================================================*/
 
 
+#include <atomic>
+
 /*=============================================================================
 * defines
 =============================================================================*/
 #define SBRK_FAIL (void *)(-1)
-#define ALIGN_TO_MULT_OF_4(x) (((((x) - 1) >> 2) << 2) + 4)
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+// alignment of every payload, 8 or 16. stricter alignments are served by
+// customAlignedAlloc.
+#ifndef CUSTOM_ALIGNMENT
+#define CUSTOM_ALIGNMENT alignof(max_align_t)
+#endif
+#define BLOCK_MAGIC 0xB10C4EADu
+// requests of at least this many bytes get their own mmap'd region
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+// free space at the top of the single thread heap of at least this many bytes
+// goes back with sbrk right away, 0 releases any
+#define DEFAULT_TRIM_THRESHOLD 0
+// free blocks of at least this many bytes give their interior pages back
+#define TRIM_INTERIOR_MIN (1024 * 1024)
 #define NUM_AREAS 8
 #define AREA_SIZE 4096 
+#define DEFAULT_MAX_AREA_SIZE (64 * 1024 * 1024)
+#define MAX_AREAS 65536
+#define MAX_CPU_AREAS 1024
+// areas of a heap with HeapConfig::huge_pages are multiples of this, at
+// addresses aligned to it
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+// size classes: exact 16 byte steps below SMALL_CLASS_LIMIT, then 4 classes
+// per power of two. the last class catches everything bigger.
+#define SMALL_CLASS_LIMIT 512
+#define CLASS_SUBDIVISIONS 4
+#define NUM_SIZE_CLASSES 128
+#define CLASS_BITMAP_WORDS (NUM_SIZE_CLASSES / 64)
+
+// deferred coalescing: freed blocks below QUICK_LIMIT wait unmerged on quick
+// lists, 16 byte classes, until a request misses or QUICK_MAX_BLOCKS pile up
+#define QUICK_LIMIT 512
+#define QUICK_NUM_CLASSES (QUICK_LIMIT / 16)
+#define QUICK_MAX_BLOCKS 128
+
+// slabs for small objects: one page per slab, objects of SLAB_NUM_CLASSES
+// sizes in 16 byte steps, carved from a reserved range per heap
+#define SLAB_SIZE 4096
+#define SLAB_NUM_CLASSES 4
+#define SLAB_MAX_SIZE (SLAB_NUM_CLASSES * 16)
+#define SLAB_HEADER_SIZE 128
+#define SLAB_BITMAP_WORDS 4
+#define SLAB_REGION_SIZE ((size_t)256 * 1024 * 1024)
+#define SLAB_MAGIC 0x51AB51ABu
+
+// per thread cache in front of the MT heap: 16 byte classes below 512 bytes
+#define TCACHE_NUM_CLASSES 32
+#define TCACHE_DEFAULT_DEPTH 16
+#define TCACHE_BATCH 8
 /*=============================================================================
 * Block
 =============================================================================*/
-// suggestion for block usage - feel free to change this
+// flags kept in the low bits of Block::size, sizes are multiples of 8
+#define BLOCK_FREE 1      // on a free list
+#define BLOCK_PREV_FREE 2 // the block before is free and has a footer
+#define BLOCK_MMAPPED 4   // a single block in its own mapping, see mmapBlock
+#define BLOCK_FLAGS 7
+
+// 16 byte header. blocks of a heap or an area are laid out back to back and
+// end in a fence header of size 0 that is never free, so the next block is
+// always found from the size. a free block ends in a footer repeating its
+// size, which is how the block after it finds it when coalescing.
 typedef struct Block {
-  size_t size;
-  bool is_free;
-  Block *next;
-  Block *prev;
-  pthread_mutex_t* lock;
+  size_t size;          // payload bytes | BLOCK_* flags
+  unsigned int magic;   // blockMagic(block) while the header is live
+  unsigned int area_id; // owning area in the MT heap, see mappingFront for
+                        // a mapped block, 0 otherwise
 } Block;
 
+// free blocks keep their size class list links at the start of the payload
+typedef struct FreeLinks {
+  Block *next_free;
+  Block *prev_free;
+} FreeLinks;
+
+#define MIN_BLOCK_SIZE (sizeof(FreeLinks) + sizeof(size_t))
+
+// segregated free lists, one per size class, with a bitmap of non empty
+// classes. quick lists hold blocks freed in deferred coalescing mode, which
+// stay marked in use until they are merged.
+typedef struct FreeBins {
+  Block *heads[NUM_SIZE_CLASSES];
+  unsigned long long nonempty[CLASS_BITMAP_WORDS];
+  Block *quick[QUICK_NUM_CLASSES];
+  size_t quick_count;
+} FreeBins;
+
+// header at the start of each slab page. free objects have their bit set.
+typedef struct Slab {
+  unsigned int magic;
+  unsigned int object_size;
+  unsigned int capacity;
+  unsigned int free_count;
+  Slab *next; // partial slabs of the class, or the pool of empty slabs
+  Slab *prev;
+  unsigned long long free_bits[SLAB_BITMAP_WORDS];
+} Slab;
+
+typedef struct SlabHeap {
+  char *base;   // reserved range, slabs are carved from it in order
+  char *unused; // first slab never handed out
+  char *end;
+  Slab *empty;  // pool of slabs with every object free
+  Slab *partial[SLAB_NUM_CLASSES];
+  bool thread_safe;
+  pthread_mutex_t pool_lock;
+  pthread_mutex_t class_locks[SLAB_NUM_CLASSES];
+} SlabHeap;
+
 extern Block *block_list;
 
+// area locks are held for a best fit search and a split. a thread that finds
+// one taken spins a while, then sleeps on the futex word. state is 0 free,
+// 1 taken, 2 taken with sleepers.
+typedef struct AreaLock {
+    std::atomic<int> state;
+    std::atomic<int> spins; // recent spins to get the lock, sets the limit
+    pthread_mutex_t mutex; // used instead with HeapConfig::mutex_area_locks
+} AreaLock;
+
 typedef struct MemArea {
     Block* rr_block_list;
-    pthread_mutex_t area_lock;
-    MemArea* next;
+    FreeBins bins;
+    AreaLock area_lock;
+    size_t size; // bytes of the area's mapping, including this struct
+    unsigned int id; // index in the area table, stored in each block header
+    std::atomic<MemArea*> next;
+    std::atomic<void*> remote_frees; // freed by other threads, see remoteFree
+    unsigned long lock_acquisitions; // counted while holding area_lock
+    std::atomic<unsigned long> lock_contentions; // lock was found taken
 } MemArea;
 
+// MT heap layout. areas created on demand start at area_size and double up to
+// max_area_size, or are sized to the request when it is bigger.
+typedef struct HeapConfig {
+    size_t num_areas;     // areas created up front
+    size_t area_size;     // block space of each of those areas
+    size_t max_area_size; // cap for the geometric growth of later areas
+    bool deferred_coalescing; // merge freed blocks in batches, not on free
+    bool per_cpu_areas;   // one area per CPU, picked with sched_getcpu
+    bool huge_pages;      // areas in whole, aligned transparent huge pages
+    bool mutex_area_locks; // plain pthread mutexes for the areas
+} HeapConfig;
+
+// single thread heap with the coalescing policy of config, area fields are
+// ignored. heapCreate() is the eager default.
+void heapCreateEx(const HeapConfig *config);
+
 void heapMTCreate();
+void heapMTCreateEx(const HeapConfig *config); // nullptr for the defaults
 void heapMTKill();
 
+// sets the size from which both heaps serve requests with mmap
+void customSetMmapThreshold(size_t threshold);
+
+// sets how much free space the top of the single thread heap may hold before
+// it is released automatically
+void customSetTrimThreshold(size_t threshold);
+
+// gives free memory back to the OS: the top of the single thread heap down to
+// pad free bytes, and the interior pages of every free block. the MT areas are
+// fixed mappings, so only their free blocks' pages go back. both return 1 if
+// anything was released, 0 otherwise.
+int customTrim(size_t pad);
+int customMTTrim();
+
+/*=============================================================================
+* statistics
+=============================================================================*/
+// blocks of one size class of the free lists
+typedef struct ClassStats {
+    size_t live_blocks;
+    size_t live_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+} ClassStats;
+
+// live and empty slabs of one slab class
+typedef struct SlabStats {
+    size_t slabs;
+    size_t live_objects;
+    size_t free_objects;
+} SlabStats;
+
+// a snapshot taken by walking a heap. live blocks include those held in
+// thread caches and remote lists, held blocks are parked on quick lists or
+// cover memory another sbrk user took in the middle of the heap.
+typedef struct MallocStats {
+    size_t heap_bytes;   // break or area memory holding blocks
+    size_t live_blocks;
+    size_t live_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free; // the rest of free_bytes is fragmentation
+    size_t held_blocks;
+    size_t held_bytes;
+    size_t header_bytes; // headers of all blocks and fences
+    ClassStats classes[NUM_SIZE_CLASSES];
+    SlabStats slab_classes[SLAB_NUM_CLASSES];
+    size_t empty_slabs;
+    size_t num_areas;
+    unsigned long lock_acquisitions; // area locks, summed over the areas
+    unsigned long lock_contentions;
+    unsigned long sbrk_calls;
+    size_t large_blocks; // mmap'd blocks of the whole process
+    size_t large_bytes;
+    unsigned long mmap_calls;
+} MallocStats;
+
+// the same for one MemArea
+typedef struct AreaStats {
+    unsigned int id;
+    size_t size; // bytes of the mapping
+    size_t live_blocks;
+    size_t live_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free;
+    unsigned long lock_acquisitions;
+    unsigned long lock_contentions;
+} AreaStats;
+
+void customMallocStats(MallocStats *stats);
+// fills up to max_areas entries of areas, which may be nullptr, and returns
+// the number of areas
+size_t customMTMallocStats(MallocStats *stats, AreaStats *areas,
+                           size_t max_areas);
+
+// writes the statistics to fd as text, or as JSON if json is set. nothing is
+// allocated on the way.
+void customMallocStatsDump(int fd, bool json);
+void customMTMallocStatsDump(int fd, bool json);
+
+// max blocks kept per class in each thread's cache, 0 disables the cache
+void customMTSetCacheDepth(unsigned int depth);
+
+// size bytes at a multiple of alignment, a power of two. nullptr on failure.
+void *customAlignedAlloc(size_t alignment, size_t size);
+void *customMTAlignedAlloc(size_t alignment, size_t size);
+
+// count allocations of size bytes into out, taking each lock once for as many
+// blocks as it can hand out. returns how many were allocated, fewer than
+// count only when memory ran out.
+size_t customMTMallocBatch(size_t size, size_t count, void **out);
+// frees count MT allocations, nullptr entries are skipped
+void customMTFreeBatch(void **ptrs, size_t count);
+
+// frees ptr given the size it was allocated with, as sized operator delete
+// does. the size picks the slab or block path and ptr is trusted, only debug
+// builds check both against the allocation.
+void customFreeSized(void *ptr, size_t size);
+void customMTFreeSized(void *ptr, size_t size);
+
+// bytes that can be used at ptr, a live MT allocation, at least the size
+// asked for. 0 for nullptr.
+size_t customMTUsableSize(void *ptr);
+
+// pthread_atfork handlers for the MT heap. prepare takes every heap lock so
+// that a child never starts with a lock held by a thread it does not have.
+void heapMTForkPrepare();
+void heapMTForkParent();
+void heapMTForkChild();
+
+/*=============================================================================
+* heap profiling
+=============================================================================*/
+// mean bytes allocated between two samples
+#define PROFILE_DEFAULT_RATE (2 * 1024 * 1024)
+#define PROFILE_MAX_DEPTH 32
+
+// samples about one customMalloc/customMTMalloc per rate bytes and keeps its
+// stack until the object is freed. 0 stops sampling, samples already taken
+// stay until their objects are freed.
+void customSetProfileRate(size_t rate);
+
+// writes the live samples to fd as a heap profile pprof reads, or as text
+// with symbolised stacks. nothing is allocated on the way.
+void customHeapProfileDump(int fd, bool pprof);
+
+/*=============================================================================
+* regions
+=============================================================================*/
+// bump allocation for objects that all die at the same time, such as the
+// temporaries of one request. chunks come from one of the heaps and are kept
+// for reuse until the region is destroyed.
+#define REGION_DEFAULT_CHUNK (64 * 1024)
+
+typedef struct RegionChunk {
+    struct RegionChunk *next;
+    size_t size; // bytes of bump space after the header
+} RegionChunk;
+
+typedef struct Region {
+    RegionChunk *first;   // chunks in the order they are filled
+    RegionChunk *current;
+    char *cursor;         // next free byte of current
+    char *limit;
+    size_t chunk_size;
+    bool mt;              // chunks come from the MT heap
+} Region;
+
+// a region with chunks of chunk_size bytes, 0 for the default, from the
+// single thread heap or from the MT heap if mt is set. the region itself is
+// for one thread at a time.
+Region *regionCreate(size_t chunk_size, bool mt);
+// size bytes aligned like customMalloc's, nullptr on failure. objects are
+// not freed one by one.
+void *regionAlloc(Region *region, size_t size);
+// drops everything allocated from the region in O(1), its chunks are filled
+// again from the first one
+void regionReset(Region *region);
+void regionDestroy(Region *region);
+
 #endif // CUSTOM_ALLOCATOR
@@ -0,0 +1,156 @@
+// the malloc family on top of the MT heap, built into libcustommalloc.so so a
+// program runs on this allocator without relinking:
+//   LD_PRELOAD=./libcustommalloc.so ./app
+// with MALLOC_PROFILE_FILE set the heap profiler samples every
+// MALLOC_PROFILE_RATE bytes (PROFILE_DEFAULT_RATE if unset) and writes a
+// pprof heap profile of what is still live at exit.
+// the heap is created by the first call, from whichever thread makes it. its
+// paths only use mmap and pthreads, nothing here may print or allocate
+// through libstdc++ since that would come back into malloc.
+#include "malloc_preload.h"
+#include "customAllocator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+bool preload_heap_ready = false;
+
+static void heapInit() {
+  heapMTCreate();
+  preload_heap_ready = true;
+}
+
+void preloadHeapInit() { pthread_once(&heap_once, heapInit); }
+
+// registering may allocate, which is why it is not part of heapInit: a
+// malloc from inside pthread_once would wait on itself
+__attribute__((constructor)) static void registerForkHandlers() {
+  ensureHeap();
+  pthread_atfork(heapMTForkPrepare, heapMTForkParent, heapMTForkChild);
+}
+
+static void dumpProfile() {
+  int fd = open(getenv("MALLOC_PROFILE_FILE"),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  customHeapProfileDump(fd, true);
+  close(fd);
+}
+
+__attribute__((constructor)) static void startProfiler() {
+  if (getenv("MALLOC_PROFILE_FILE") == nullptr)
+    return;
+  const char *rate = getenv("MALLOC_PROFILE_RATE");
+  customSetProfileRate(rate != nullptr ? strtoull(rate, nullptr, 10)
+                                       : PROFILE_DEFAULT_RATE);
+  atexit(dumpProfile);
+}
+
+static bool isPowerOfTwo(size_t x) { return x != 0 && (x & (x - 1)) == 0; }
+
+static size_t pageSize() {
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+// malloc(0) and friends hand out a unique pointer, as glibc's do
+static void *alignedAlloc(size_t alignment, size_t size) {
+  if (tooLarge(size)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  ensureHeap();
+  void *ptr = customMTAlignedAlloc(alignment, size == 0 ? 1 : size);
+  if (ptr == nullptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+  if (tooLarge(size)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  ensureHeap();
+  void *ptr = customMTMalloc(size == 0 ? 1 : size);
+  if (ptr == nullptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+void free(void *ptr) {
+  if (ptr != nullptr)
+    customMTFree(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > PTRDIFF_MAX / size) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  ensureHeap();
+  if (nmemb == 0 || size == 0)
+    nmemb = size = 1;
+  void *ptr = customMTCalloc(nmemb, size);
+  if (ptr == nullptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  ensureHeap();
+  if (ptr == nullptr)
+    return malloc(size);
+  if (tooLarge(size)) {
+    errno = ENOMEM;
+    return nullptr; // ptr stays valid
+  }
+
+  void *moved = customMTRealloc(ptr, size);
+  if (moved == nullptr && size != 0)
+    errno = ENOMEM;
+  return moved;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!isPowerOfTwo(alignment) || alignment % sizeof(void *) != 0)
+    return EINVAL;
+
+  void *ptr = alignedAlloc(alignment, size);
+  if (ptr == nullptr)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (!isPowerOfTwo(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return alignedAlloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) { return alignedAlloc(pageSize(), size); }
+
+void *pvalloc(size_t size) {
+  if (tooLarge(size)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  size_t page_mask = pageSize() - 1;
+  return alignedAlloc(pageSize(), (size + page_mask) & ~page_mask);
+}
+
+size_t malloc_usable_size(void *ptr) { return customMTUsableSize(ptr); }
+
+} // extern "C"
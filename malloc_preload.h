@@ -0,0 +1,21 @@
+#ifndef __MALLOC_PRELOAD__
+#define __MALLOC_PRELOAD__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the MT heap behind libcustommalloc.so, created by the first call into the
+// library from whichever thread makes it
+extern bool preload_heap_ready;
+void preloadHeapInit();
+
+static inline void ensureHeap() {
+  if (!__builtin_expect(preload_heap_ready, true))
+    preloadHeapInit();
+}
+
+// no object is bigger than PTRDIFF_MAX, such requests fail up front as they
+// do in glibc
+static inline bool tooLarge(size_t size) { return size > PTRDIFF_MAX; }
+
+#endif // __MALLOC_PRELOAD__
@@ -0,0 +1,213 @@
+// LD_PRELOAD shim that records the malloc family calls of a program into a
+// trace file for my_replay:
+//   MALLOC_TRACE_FILE=app.trace LD_PRELOAD=./libmalloctrace.so ./app
+// calls go on to the next malloc in the search order, usually glibc's.
+#include "malloc_trace.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef void *(*MallocFn)(size_t);
+typedef void (*FreeFn)(void *);
+typedef void *(*CallocFn)(size_t, size_t);
+typedef void *(*ReallocFn)(void *, size_t);
+typedef int (*PosixMemalignFn)(void **, size_t, size_t);
+typedef void *(*AlignedAllocFn)(size_t, size_t);
+
+static MallocFn real_malloc = nullptr;
+static FreeFn real_free = nullptr;
+static CallocFn real_calloc = nullptr;
+static ReallocFn real_realloc = nullptr;
+static PosixMemalignFn real_posix_memalign = nullptr;
+static AlignedAllocFn real_aligned_alloc = nullptr;
+static AlignedAllocFn real_memalign = nullptr;
+
+/*=============================================================================
+* bootstrap
+=============================================================================*/
+// dlsym may allocate while the real functions are looked up. those requests
+// are served from a static buffer and never go back.
+static char bootstrap[4096];
+static size_t bootstrap_used = 0;
+static bool resolving = false;
+
+static void *bootstrapAlloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (bootstrap_used + size > sizeof(bootstrap))
+    return nullptr;
+  void *ptr = bootstrap + bootstrap_used;
+  bootstrap_used += size;
+  return ptr;
+}
+
+static bool isBootstrap(void *ptr) {
+  return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + sizeof(bootstrap);
+}
+
+template <typename Fn> static void lookup(Fn &fn, const char *name) {
+  void *symbol = dlsym(RTLD_NEXT, name);
+  memcpy(&fn, &symbol, sizeof(fn));
+}
+
+static void resolve() {
+  if (real_malloc != nullptr || resolving)
+    return;
+  resolving = true;
+  lookup(real_calloc, "calloc");
+  lookup(real_free, "free");
+  lookup(real_realloc, "realloc");
+  lookup(real_posix_memalign, "posix_memalign");
+  lookup(real_aligned_alloc, "aligned_alloc");
+  lookup(real_memalign, "memalign");
+  lookup(real_malloc, "malloc");
+  resolving = false;
+}
+
+/*=============================================================================
+* recording
+=============================================================================*/
+#define TRACE_BUFFER_RECORDS 4096
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static TraceRecord buffer[TRACE_BUFFER_RECORDS];
+static size_t buffered = 0;
+static uint32_t threads_seen = 0;
+static thread_local uint32_t thread_number = 0;
+
+// called with trace_lock held
+static void flushBuffer() {
+  if (trace_fd < 0) {
+    const char *path = getenv(TRACE_FILE_ENV);
+    if (path == nullptr)
+      path = TRACE_DEFAULT_FILE;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+
+  size_t bytes = buffered * sizeof(TraceRecord);
+  size_t done = 0;
+  while (trace_fd >= 0 && done < bytes) {
+    ssize_t n = write(trace_fd, (char *)buffer + done, bytes - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  buffered = 0;
+}
+
+// called with trace_lock held
+static void recordLocked(uint32_t op, size_t size, size_t align, void *ptr,
+                         void *result) {
+  if (thread_number == 0)
+    thread_number = ++threads_seen;
+
+  TraceRecord *entry = &buffer[buffered++];
+  entry->op = op;
+  entry->thread = thread_number;
+  entry->size = size;
+  entry->align = align;
+  entry->ptr = (uint64_t)ptr;
+  entry->result = (uint64_t)result;
+
+  if (buffered == TRACE_BUFFER_RECORDS)
+    flushBuffer();
+}
+
+static void record(uint32_t op, size_t size, size_t align, void *ptr,
+                   void *result) {
+  pthread_mutex_lock(&trace_lock);
+  recordLocked(op, size, align, ptr, result);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((destructor)) static void traceExit() {
+  pthread_mutex_lock(&trace_lock);
+  flushBuffer();
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/*=============================================================================
+* malloc family
+=============================================================================*/
+// results are recorded after the call and frees before it, so a trace never
+// shows an address handed out again before it was freed. realloc does both,
+// it holds the trace lock over the call.
+extern "C" {
+
+void *malloc(size_t size) {
+  resolve();
+  if (real_malloc == nullptr)
+    return bootstrapAlloc(size);
+
+  void *result = real_malloc(size);
+  record(TRACE_MALLOC, size, 0, nullptr, result);
+  return result;
+}
+
+void free(void *ptr) {
+  if (ptr == nullptr || isBootstrap(ptr))
+    return;
+  resolve();
+
+  record(TRACE_FREE, 0, 0, ptr, nullptr);
+  real_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  resolve();
+  if (real_calloc == nullptr) {
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+      return nullptr;
+    return bootstrapAlloc(bytes); // static memory is zeroed
+  }
+
+  void *result = real_calloc(nmemb, size);
+  record(TRACE_CALLOC, nmemb * size, 0, nullptr, result);
+  return result;
+}
+
+void *realloc(void *ptr, size_t size) {
+  resolve();
+  if (isBootstrap(ptr)) {
+    // moves out of the bootstrap buffer, which is never reused
+    void *result = malloc(size);
+    size_t available = bootstrap + sizeof(bootstrap) - (char *)ptr;
+    if (result != nullptr)
+      memcpy(result, ptr, size < available ? size : available);
+    return result;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  void *result = real_realloc(ptr, size);
+  recordLocked(TRACE_REALLOC, size, 0, ptr, result);
+  pthread_mutex_unlock(&trace_lock);
+  return result;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  resolve();
+  int error = real_posix_memalign(memptr, alignment, size);
+  if (error == 0)
+    record(TRACE_MEMALIGN, size, alignment, nullptr, *memptr);
+  return error;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  resolve();
+  void *result = real_aligned_alloc(alignment, size);
+  record(TRACE_MEMALIGN, size, alignment, nullptr, result);
+  return result;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  resolve();
+  void *result = real_memalign(alignment, size);
+  record(TRACE_MEMALIGN, size, alignment, nullptr, result);
+  return result;
+}
+
+} // extern "C"
@@ -0,0 +1,28 @@
+#ifndef __MALLOC_TRACE__
+#define __MALLOC_TRACE__
+
+#include <stdint.h>
+
+// one call recorded by the malloc_trace shim. a trace file is a plain
+// sequence of these in call order, across all threads.
+enum TraceOp {
+  TRACE_MALLOC = 1,
+  TRACE_FREE = 2,
+  TRACE_CALLOC = 3,
+  TRACE_REALLOC = 4,
+  TRACE_MEMALIGN = 5,
+};
+
+typedef struct TraceRecord {
+  uint32_t op;
+  uint32_t thread; // small per thread number, in order of first call
+  uint64_t size;   // bytes asked for, nmemb * size for calloc
+  uint64_t align;  // TRACE_MEMALIGN only
+  uint64_t ptr;    // argument of free and realloc
+  uint64_t result; // returned pointer
+} TraceRecord;
+
+#define TRACE_FILE_ENV "MALLOC_TRACE_FILE"
+#define TRACE_DEFAULT_FILE "malloc.trace"
+
+#endif // __MALLOC_TRACE__
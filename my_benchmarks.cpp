@@ -0,0 +1,628 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "customAllocator.h"
+
+// Helper macro for printing
+#define RUN_BENCH(bench) \
+    std::cout << "Running " << #bench << "... " << std::flush; \
+    bench(); \
+    std::cout << std::endl;
+
+#define TRACE_OPS 200000
+#define TRACE_SLOTS 20000
+
+// one step of an allocation trace: size 0 frees the slot, anything else
+// allocates into it
+struct TraceOp {
+    unsigned int slot;
+    unsigned int size;
+};
+
+static TraceOp trace[TRACE_OPS];
+static void* slots[TRACE_SLOTS];
+
+double now_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// deterministic mixed size trace that keeps about TRACE_SLOTS / 2 blocks live
+void build_trace() {
+    bool live[TRACE_SLOTS] = {};
+    unsigned long long seed = 42;
+
+    for (int i = 0; i < TRACE_OPS; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        unsigned int slot = (unsigned int)(seed >> 33) % TRACE_SLOTS;
+        unsigned int size = 8 + (unsigned int)(seed >> 20) % 1000;
+
+        trace[i].slot = slot;
+        trace[i].size = live[slot] ? 0 : size;
+        live[slot] = !live[slot];
+    }
+}
+
+// replays the trace and returns operations per second
+double replay(void* (*alloc)(size_t), void (*release)(void*)) {
+    memset(slots, 0, sizeof(slots));
+    double start = now_seconds();
+
+    for (int i = 0; i < TRACE_OPS; i++) {
+        if (trace[i].size == 0) {
+            release(slots[trace[i].slot]);
+            slots[trace[i].slot] = nullptr;
+        } else {
+            slots[trace[i].slot] = alloc(trace[i].size);
+            memset(slots[trace[i].slot], 0, 8);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+
+    for (int i = 0; i < TRACE_SLOTS; i++) {
+        if (slots[i] != nullptr) release(slots[i]);
+    }
+    return TRACE_OPS / elapsed;
+}
+
+// part A - single thread heap over the mixed trace
+void bench_trace_malloc() {
+    double ops = replay(customMalloc, customFree);
+    heapKill();
+    std::cout << (long)ops << " ops/sec";
+}
+
+// part B - the same trace through the MT heap from a single thread
+void bench_trace_mt_malloc() {
+    heapMTCreate();
+    double ops = replay(customMTMalloc, customMTFree);
+    heapMTKill();
+    std::cout << (long)ops << " ops/sec";
+}
+
+#define PROFILE_REPEATS 20
+
+// thread CPU seconds for one replay of the trace on the MT heap, which other
+// guests and threads of the machine do not add to
+double replay_cpu_seconds() {
+    timespec before, after;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &before);
+    replay(customMTMalloc, customMTFree);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &after);
+    return (after.tv_sec - before.tv_sec) +
+           (after.tv_nsec - before.tv_nsec) / 1e9;
+}
+
+// the MT trace with the heap profiler off and sampling at its default rate,
+// alternating, best of PROFILE_REPEATS runs each
+void bench_trace_mt_malloc_profiled() {
+    double plain = 1e9, profiled = 1e9;
+    heapMTCreate();
+    for (int i = 0; i < PROFILE_REPEATS; i++) {
+        customSetProfileRate(0);
+        plain = std::min(plain, replay_cpu_seconds());
+        customSetProfileRate(PROFILE_DEFAULT_RATE);
+        profiled = std::min(profiled, replay_cpu_seconds());
+    }
+    customSetProfileRate(0);
+    heapMTKill();
+    std::cout << (long)(TRACE_OPS / profiled) << " ops/sec, overhead "
+              << (profiled - plain) / plain * 100 << "%";
+}
+
+#define OVERHEAD_OBJECTS 10000
+
+// address span per live object beyond the bytes asked for, so slab objects
+// count the same as blocks on the break
+void bench_header_overhead() {
+    static void* objects[OVERHEAD_OBJECTS];
+    size_t sizes[] = { 8, 16, 24, 48, 100 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char* low = nullptr;
+        char* high = nullptr;
+        for (int i = 0; i < OVERHEAD_OBJECTS; i++) {
+            objects[i] = customMalloc(sizes[s]);
+            char* p = (char*)objects[i];
+            if (low == nullptr || p < low) low = p;
+            if (high == nullptr || p > high) high = p;
+        }
+        double per_object = (double)(high - low) / (OVERHEAD_OBJECTS - 1);
+        for (int i = OVERHEAD_OBJECTS - 1; i >= 0; i--) {
+            customFree(objects[i]);
+        }
+        std::cout << std::endl << "  " << sizes[s] << " byte objects: "
+                  << per_object - sizes[s] << " bytes overhead";
+    }
+    heapKill();
+}
+
+#define CHURN_OPS 500000
+#define CHURN_LIVE 64
+
+// a few exact sizes freed and allocated again right away, which eager
+// coalescing merges and splits over and over
+double run_st_churn(bool deferred) {
+    HeapConfig config = {};
+    config.deferred_coalescing = deferred;
+    heapCreateEx(&config);
+
+    static void* live[CHURN_LIVE];
+    size_t sizes[] = { 80, 96, 160, 240 };
+    for (int i = 0; i < CHURN_LIVE; i++) live[i] = customMalloc(sizes[i % 4]);
+
+    unsigned long long seed = 7;
+    double start = now_seconds();
+    for (int i = 0; i < CHURN_OPS; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int slot = (int)(seed >> 33) % CHURN_LIVE;
+        customFree(live[slot]);
+        live[slot] = customMalloc(sizes[(seed >> 20) % 4]);
+    }
+    double elapsed = now_seconds() - start;
+
+    for (int i = 0; i < CHURN_LIVE; i++) customFree(live[i]);
+    heapKill();
+    return 2.0 * CHURN_OPS / elapsed;
+}
+
+void bench_st_churn_eager() {
+    std::cout << (long)run_st_churn(false) << " ops/sec";
+}
+
+void bench_st_churn_deferred() {
+    std::cout << (long)run_st_churn(true) << " ops/sec";
+}
+
+#define GROWTH_ROUNDS 20
+#define GROWTH_LIMIT (100 * 1024)
+
+// a buffer grown 64 bytes at a time, as an appending vector would. it sits
+// at the top of the heap and grows with the break.
+void bench_st_realloc_growth() {
+    long calls = 0;
+    double start = now_seconds();
+    for (int round = 0; round < GROWTH_ROUNDS; round++) {
+        char* buffer = (char*)customMalloc(64);
+        for (size_t size = 128; size <= GROWTH_LIMIT; size += 64) {
+            buffer = (char*)customRealloc(buffer, size);
+            buffer[size - 1] = 1;
+            calls++;
+        }
+        customFree(buffer);
+    }
+    double elapsed = now_seconds() - start;
+    heapKill();
+    std::cout << (long)(calls / elapsed) << " reallocs/sec";
+}
+
+#define REQUESTS 5000
+#define REQUEST_OBJECTS 300
+
+// a request handler's temporaries: a few hundred mixed size objects, all
+// dropped when the request ends, one by one or with a region reset
+double run_requests(bool region) {
+    static void* temps[REQUEST_OBJECTS];
+    Region* arena = region ? regionCreate(0, false) : nullptr;
+    double start = now_seconds();
+
+    for (int request = 0; request < REQUESTS; request++) {
+        for (int i = 0; i < REQUEST_OBJECTS; i++) {
+            size_t size = 80 + (i * 37) % 400;
+            temps[i] = region ? regionAlloc(arena, size) : customMalloc(size);
+            memset(temps[i], 0, 8);
+        }
+        if (region) {
+            regionReset(arena);
+        } else {
+            for (int i = 0; i < REQUEST_OBJECTS; i++) customFree(temps[i]);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    if (region) regionDestroy(arena);
+    heapKill();
+    return (double)REQUESTS * REQUEST_OBJECTS / elapsed;
+}
+
+void bench_st_requests_free() {
+    std::cout << (long)run_requests(false) << " objects/sec";
+}
+
+void bench_st_requests_region() {
+    std::cout << (long)run_requests(true) << " objects/sec";
+}
+
+#define CHURN_THREADS 32
+#define CHURN_ROUNDS 20000
+
+void* churn_task(void*) {
+    void* held[8];
+    for (int i = 0; i < CHURN_ROUNDS; i++) {
+        for (int j = 0; j < 8; j++) held[j] = customMTMalloc(16 + j * 24);
+        for (int j = 0; j < 8; j++) customMTFree(held[j]);
+    }
+    return nullptr;
+}
+
+// small object malloc/free churn from many threads
+double run_churn(const HeapConfig* config = nullptr) {
+    heapMTCreateEx(config);
+    pthread_t threads[CHURN_THREADS];
+    double start = now_seconds();
+
+    for (int i = 0; i < CHURN_THREADS; i++) {
+        pthread_create(&threads[i], nullptr, churn_task, nullptr);
+    }
+    for (int i = 0; i < CHURN_THREADS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    double elapsed = now_seconds() - start;
+    heapMTKill();
+    return 2.0 * 8 * CHURN_ROUNDS * CHURN_THREADS / elapsed;
+}
+
+void bench_mt_churn_no_cache() {
+    customMTSetCacheDepth(0);
+    double ops = run_churn();
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+    std::cout << (long)ops << " ops/sec";
+}
+
+// the areas park freed blocks instead of the thread cache
+void bench_mt_churn_deferred() {
+    HeapConfig config = { NUM_AREAS, AREA_SIZE, DEFAULT_MAX_AREA_SIZE, true };
+    customMTSetCacheDepth(0);
+    double ops = run_churn(&config);
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+    std::cout << (long)ops << " ops/sec";
+}
+
+// every CPU has its own area, so threads on different CPUs never meet on a
+// lock. the thread cache is off to show the areas alone.
+void bench_mt_churn_per_cpu() {
+    HeapConfig config = { NUM_AREAS, AREA_SIZE, DEFAULT_MAX_AREA_SIZE, false,
+                          true };
+    customMTSetCacheDepth(0);
+    double ops = run_churn(&config);
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+    std::cout << (long)ops << " ops/sec";
+}
+
+void bench_mt_churn_thread_cache() {
+    std::cout << (long)run_churn() << " ops/sec";
+}
+
+#define BATCH_NODES 1000
+#define BATCH_ROUNDS 500
+
+// builds and drops BATCH_NODES same size nodes at once, one call per node
+// or one call for all of them
+double run_nodes(bool batched) {
+    static void* nodes[BATCH_NODES];
+    heapMTCreate();
+    double start = now_seconds();
+
+    for (int round = 0; round < BATCH_ROUNDS; round++) {
+        if (batched) {
+            customMTMallocBatch(96, BATCH_NODES, nodes);
+        } else {
+            for (int i = 0; i < BATCH_NODES; i++) nodes[i] = customMTMalloc(96);
+        }
+        for (int i = 0; i < BATCH_NODES; i++) memset(nodes[i], 0, 8);
+        if (batched) {
+            customMTFreeBatch(nodes, BATCH_NODES);
+        } else {
+            for (int i = 0; i < BATCH_NODES; i++) customMTFree(nodes[i]);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    heapMTKill();
+    return 2.0 * BATCH_NODES * BATCH_ROUNDS / elapsed;
+}
+
+void bench_mt_nodes_one_by_one() {
+    std::cout << (long)run_nodes(false) << " ops/sec";
+}
+
+void bench_mt_nodes_batch() {
+    std::cout << (long)run_nodes(true) << " ops/sec";
+}
+
+#define WALK_BLOCKS (512 * 1024)
+#define WALK_BLOCK_SIZE 256
+#define WALK_STEPS (4 * 1024 * 1024)
+
+// counts the dTLB load misses of this thread from user space, -1 when perf
+// events are not available here
+static int open_tlb_counter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// touches WALK_STEPS blocks picked at random out of a working set far
+// larger than the TLB reaches with 4 KB pages
+void run_random_walk(bool huge) {
+    static void* blocks[WALK_BLOCKS];
+    HeapConfig config = { NUM_AREAS, AREA_SIZE, DEFAULT_MAX_AREA_SIZE, false,
+                          false, huge };
+    heapMTCreateEx(&config);
+    for (int i = 0; i < WALK_BLOCKS; i++) {
+        blocks[i] = customMTMalloc(WALK_BLOCK_SIZE);
+        memset(blocks[i], i, WALK_BLOCK_SIZE);
+    }
+
+    int counter = open_tlb_counter();
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    unsigned long long seed = 7;
+    unsigned long sum = 0;
+    double start = now_seconds();
+
+    for (int i = 0; i < WALK_STEPS; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        unsigned char* block = (unsigned char*)blocks[(seed >> 33) % WALK_BLOCKS];
+        size_t offset = (seed >> 16) % WALK_BLOCK_SIZE;
+        sum += block[offset];
+        block[offset] = (unsigned char)sum;
+    }
+
+    double elapsed = now_seconds() - start;
+    long long misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(counter);
+    }
+    for (int i = 0; i < WALK_BLOCKS; i++) customMTFree(blocks[i]);
+    heapMTKill();
+
+    std::cout << (long)(WALK_STEPS / elapsed) << " accesses/sec, dTLB misses: ";
+    if (misses < 0) {
+        std::cout << "n/a";
+    } else {
+        std::cout << misses;
+    }
+    if (sum == 1) std::cout << " "; // keeps the reads
+}
+
+void bench_mt_random_access_small_pages() {
+    run_random_walk(false);
+}
+
+void bench_mt_random_access_huge_pages() {
+    run_random_walk(true);
+}
+
+#define CONTENTION_THREADS 16
+#define CONTENTION_ROUNDS 20000
+
+// test_mt_contention's pattern without the sleeps: every thread allocates,
+// writes, checks and frees mixed sizes while keeping a few blocks live
+void* contention_task(void* arg) {
+    long id = (long)arg;
+    int* live[4] = {};
+
+    for (int i = 0; i < CONTENTION_ROUNDS; ++i) {
+        size_t s = (i % 50 + 1) * 8;
+        int*& slot = live[i % 4];
+        if (slot != nullptr) {
+            if (*slot != id) std::cerr << "corrupted block" << std::endl;
+            customMTFree(slot);
+        }
+        slot = (int*)customMTMalloc(s);
+        *slot = (int)id;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (live[i] != nullptr) customMTFree(live[i]);
+    }
+    return nullptr;
+}
+
+// area lock contention with the thread cache off, so every call hits an area
+void bench_mt_contention() {
+    customMTSetCacheDepth(0);
+    heapMTCreate();
+    pthread_t threads[CONTENTION_THREADS];
+    double start = now_seconds();
+
+    for (long i = 0; i < CONTENTION_THREADS; i++) {
+        pthread_create(&threads[i], nullptr, contention_task, (void*)i);
+    }
+    for (int i = 0; i < CONTENTION_THREADS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    double elapsed = now_seconds() - start;
+    heapMTKill();
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+    std::cout << (long)(2.0 * CONTENTION_ROUNDS * CONTENTION_THREADS / elapsed)
+              << " ops/sec";
+}
+
+#define LOCK_MAX_THREADS 64
+#define LOCK_ROUNDS 5000
+
+void* area_lock_task(void*) {
+    for (int i = 0; i < LOCK_ROUNDS; i++) {
+        void* block = customMTMalloc(100 + (i % 8) * 50);
+        memset(block, 0, 8);
+        customMTFree(block);
+    }
+    return nullptr;
+}
+
+// malloc/free pairs on two areas with the thread cache off, so threads meet
+// on the area locks, at 1 to LOCK_MAX_THREADS threads
+void run_area_locks(bool mutex) {
+    for (int count = 1; count <= LOCK_MAX_THREADS; count *= 2) {
+        HeapConfig config = { 2, AREA_SIZE, DEFAULT_MAX_AREA_SIZE, false,
+                              false, false, mutex };
+        customMTSetCacheDepth(0);
+        heapMTCreateEx(&config);
+        pthread_t threads[LOCK_MAX_THREADS];
+        double start = now_seconds();
+
+        for (int i = 0; i < count; i++) {
+            pthread_create(&threads[i], nullptr, area_lock_task, nullptr);
+        }
+        for (int i = 0; i < count; i++) {
+            pthread_join(threads[i], nullptr);
+        }
+
+        double elapsed = now_seconds() - start;
+        heapMTKill();
+        customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+        std::cout << (count > 1 ? ", " : "") << count << ": "
+                  << (long)(2.0 * LOCK_ROUNDS * count / elapsed);
+    }
+    std::cout << " ops/sec";
+}
+
+void bench_mt_area_locks_mutex() {
+    run_area_locks(true);
+}
+
+void bench_mt_area_locks_spin_futex() {
+    run_area_locks(false);
+}
+
+#define PIPELINE_PAIRS 4
+#define PIPELINE_ITEMS 50000
+#define PIPELINE_RING 256
+
+// a single producer, single consumer ring of blocks
+struct Pipeline {
+    std::atomic<void*> ring[PIPELINE_RING];
+};
+
+static Pipeline pipelines[PIPELINE_PAIRS];
+
+void* producer_task(void* arg) {
+    Pipeline* pipe = (Pipeline*)arg;
+    for (int i = 0; i < PIPELINE_ITEMS; i++) {
+        std::atomic<void*>& slot = pipe->ring[i % PIPELINE_RING];
+        while (slot.load(std::memory_order_acquire) != nullptr) sched_yield();
+        void* ptr = customMTMalloc(600 + (i % 8) * 64);
+        memset(ptr, 0, 8);
+        slot.store(ptr, std::memory_order_release);
+    }
+    return nullptr;
+}
+
+void* consumer_task(void* arg) {
+    Pipeline* pipe = (Pipeline*)arg;
+    for (int i = 0; i < PIPELINE_ITEMS; i++) {
+        std::atomic<void*>& slot = pipe->ring[i % PIPELINE_RING];
+        void* ptr;
+        while ((ptr = slot.load(std::memory_order_acquire)) == nullptr) {
+            sched_yield();
+        }
+        slot.store(nullptr, std::memory_order_release);
+        customMTFree(ptr);
+    }
+    return nullptr;
+}
+
+// blocks allocated by one thread and freed by another, above the thread
+// cache sizes so every free reaches an area
+void bench_mt_producer_consumer() {
+    heapMTCreate();
+    pthread_t threads[2 * PIPELINE_PAIRS];
+    double start = now_seconds();
+
+    for (int i = 0; i < PIPELINE_PAIRS; i++) {
+        for (int j = 0; j < PIPELINE_RING; j++) pipelines[i].ring[j] = nullptr;
+        pthread_create(&threads[2 * i], nullptr, producer_task, &pipelines[i]);
+        pthread_create(&threads[2 * i + 1], nullptr, consumer_task,
+                       &pipelines[i]);
+    }
+    for (int i = 0; i < 2 * PIPELINE_PAIRS; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+
+    double elapsed = now_seconds() - start;
+    heapMTKill();
+    std::cout << (long)(2.0 * PIPELINE_ITEMS * PIPELINE_PAIRS / elapsed)
+              << " ops/sec";
+}
+
+int main() {
+    build_trace();
+
+    std::cout << "=== Allocation trace: " << TRACE_OPS << " ops, "
+              << TRACE_SLOTS << " slots ===" << std::endl;
+    RUN_BENCH(bench_trace_malloc);
+    RUN_BENCH(bench_trace_mt_malloc);
+    RUN_BENCH(bench_trace_mt_malloc_profiled);
+    RUN_BENCH(bench_header_overhead);
+
+    std::cout << "=== Same size churn: " << CHURN_OPS << " free/malloc pairs ==="
+              << std::endl;
+    RUN_BENCH(bench_st_churn_eager);
+    RUN_BENCH(bench_st_churn_deferred);
+
+    std::cout << "=== Realloc growth to " << GROWTH_LIMIT / 1024 << " KB ==="
+              << std::endl;
+    RUN_BENCH(bench_st_realloc_growth);
+
+    std::cout << "=== Request temporaries: " << REQUEST_OBJECTS
+              << " objects per request ===" << std::endl;
+    RUN_BENCH(bench_st_requests_free);
+    RUN_BENCH(bench_st_requests_region);
+
+    std::cout << "=== Small object churn: " << CHURN_THREADS << " threads ==="
+              << std::endl;
+    RUN_BENCH(bench_mt_churn_no_cache);
+    RUN_BENCH(bench_mt_churn_deferred);
+    RUN_BENCH(bench_mt_churn_per_cpu);
+    RUN_BENCH(bench_mt_churn_thread_cache);
+
+    std::cout << "=== Node batches: " << BATCH_NODES << " nodes ==="
+              << std::endl;
+    RUN_BENCH(bench_mt_nodes_one_by_one);
+    RUN_BENCH(bench_mt_nodes_batch);
+
+    std::cout << "=== Random access: " << WALK_BLOCKS << " blocks of "
+              << WALK_BLOCK_SIZE << " bytes ===" << std::endl;
+    RUN_BENCH(bench_mt_random_access_small_pages);
+    RUN_BENCH(bench_mt_random_access_huge_pages);
+
+    std::cout << "=== Area contention: " << CONTENTION_THREADS << " threads ==="
+              << std::endl;
+    RUN_BENCH(bench_mt_contention);
+
+    std::cout << "=== Area locks by thread count ===" << std::endl;
+    RUN_BENCH(bench_mt_area_locks_mutex);
+    RUN_BENCH(bench_mt_area_locks_spin_futex);
+
+    std::cout << "=== Cross thread frees: " << PIPELINE_PAIRS
+              << " producer/consumer pairs ===" << std::endl;
+    RUN_BENCH(bench_mt_producer_consumer);
+    return 0;
+}
@@ -0,0 +1,343 @@
+// replays a malloc trace recorded by libmalloctrace.so against the custom
+// heaps and glibc malloc:
+//   make record CMD="ls -l /usr" TRACE=ls.trace
+//   make replay TRACE=ls.trace
+// without a trace file a synthetic mixed workload is replayed instead.
+// the calls of all recorded threads are replayed in order from one thread.
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <malloc.h>
+#include <unordered_map>
+#include <vector>
+#include "customAllocator.h"
+#include "malloc_trace.h"
+
+#define SYNTHETIC_OPS 400000
+#define SYNTHETIC_SLOTS 30000
+#define FOOTPRINT_INTERVAL 4096
+
+// one call of the trace with its pointers turned into slot numbers, so a
+// replay can run without looking up addresses
+struct ReplayOp {
+    unsigned int op;
+    unsigned int slot;
+    size_t size;
+    size_t align;
+};
+
+struct Trace {
+    std::vector<ReplayOp> ops;
+    unsigned int num_slots;
+};
+
+// the functions a replay calls, with the footprint of the heap in bytes
+struct Allocator {
+    const char* name;
+    void (*create)();
+    void (*destroy)();
+    void* (*alloc)(size_t);
+    void (*release)(void*);
+    void* (*zeroed)(size_t, size_t);
+    void* (*resize)(void*, size_t);
+    void* (*aligned)(size_t, size_t);
+    size_t (*footprint)();
+};
+
+struct Result {
+    double ops_per_sec;
+    std::vector<double> latencies; // nanoseconds, sorted
+    size_t peak_footprint;
+    size_t peak_requested;         // live bytes at the peak footprint
+};
+
+double now_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*=============================================================================
+* loading
+=============================================================================*/
+static unsigned int takeSlot(std::vector<unsigned int>& spare,
+                             unsigned int& num_slots) {
+    if (spare.empty()) return num_slots++;
+    unsigned int slot = spare.back();
+    spare.pop_back();
+    return slot;
+}
+
+// maps every address to the slot of the call that returned it. frees of
+// addresses the trace never handed out (allocated before recording started)
+// are dropped, and so are failed calls.
+bool load_trace(const char* path, Trace& trace) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        std::cerr << "cannot open " << path << std::endl;
+        return false;
+    }
+
+    std::unordered_map<uint64_t, unsigned int> live;
+    std::vector<unsigned int> spare;
+    trace.num_slots = 0;
+
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        ReplayOp op = { record.op, 0, (size_t)record.size,
+                        (size_t)record.align };
+
+        if (record.op == TRACE_REALLOC && record.ptr == 0) op.op = TRACE_MALLOC;
+        if (record.op == TRACE_REALLOC && record.size == 0) op.op = TRACE_FREE;
+
+        if (op.op == TRACE_FREE || op.op == TRACE_REALLOC) {
+            auto it = live.find(record.ptr);
+            if (it == live.end()) continue;
+            op.slot = it->second;
+            if (op.op == TRACE_REALLOC) {
+                if (record.result == 0) continue; // old block is untouched
+                live.erase(it);
+                live[record.result] = op.slot;
+            } else {
+                spare.push_back(op.slot);
+                live.erase(it);
+            }
+        } else {
+            if (record.result == 0) continue;
+            op.slot = takeSlot(spare, trace.num_slots);
+            live[record.result] = op.slot;
+        }
+        trace.ops.push_back(op);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// mostly small objects with a long tail, some of them resized or aligned,
+// keeping about SYNTHETIC_SLOTS / 2 blocks live
+void build_synthetic_trace(Trace& trace) {
+    std::vector<bool> live(SYNTHETIC_SLOTS, false);
+    unsigned long long seed = 42;
+    trace.num_slots = SYNTHETIC_SLOTS;
+
+    for (int i = 0; i < SYNTHETIC_OPS; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        unsigned int slot = (unsigned int)(seed >> 33) % SYNTHETIC_SLOTS;
+        unsigned int pick = (unsigned int)(seed >> 16) % 100;
+        size_t size = 8 + (seed >> 24) % 120;
+        if (pick >= 70) size = 128 + (seed >> 24) % 2048;
+        if (pick >= 98) size = 64 * 1024 + (seed >> 24) % (256 * 1024);
+
+        ReplayOp op = { TRACE_MALLOC, slot, size, 0 };
+        if (live[slot]) {
+            op.op = pick < 20 ? TRACE_REALLOC : TRACE_FREE;
+            live[slot] = op.op == TRACE_REALLOC;
+        } else {
+            if (pick % 16 == 0) op.op = TRACE_CALLOC;
+            if (pick % 25 == 1) {
+                op.op = TRACE_MEMALIGN;
+                op.align = 64;
+            }
+            live[slot] = true;
+        }
+        trace.ops.push_back(op);
+    }
+}
+
+/*=============================================================================
+* allocators
+=============================================================================*/
+static size_t custom_footprint(const MallocStats& stats) {
+    size_t slabs = stats.empty_slabs;
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slabs += stats.slab_classes[i].slabs;
+    }
+    return stats.heap_bytes + stats.large_bytes + slabs * SLAB_SIZE;
+}
+
+size_t st_footprint() {
+    MallocStats stats;
+    customMallocStats(&stats);
+    return custom_footprint(stats);
+}
+
+size_t mt_footprint() {
+    MallocStats stats;
+    customMTMallocStats(&stats, nullptr, 0);
+    return custom_footprint(stats);
+}
+
+// whatever the process had before the first replay. glibc keeps most of the
+// first pass's heap for the second one, which then counts against its peak.
+static size_t glibc_baseline = 0;
+
+size_t glibc_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+size_t glibc_footprint() {
+    size_t in_use = glibc_in_use();
+    return in_use > glibc_baseline ? in_use - glibc_baseline : 0;
+}
+
+void glibc_create() {
+    malloc_trim(0);
+    if (glibc_baseline == 0) glibc_baseline = glibc_in_use();
+}
+
+void glibc_destroy() {
+    malloc_trim(0);
+}
+
+void* glibc_aligned(size_t alignment, size_t size) {
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+void no_op() {}
+
+static const Allocator allocators[] = {
+    { "customMalloc", no_op, heapKill, customMalloc, customFree,
+      customCalloc, customRealloc, customAlignedAlloc, st_footprint },
+    { "customMTMalloc", heapMTCreate, heapMTKill, customMTMalloc,
+      customMTFree, customMTCalloc, customMTRealloc, customMTAlignedAlloc,
+      mt_footprint },
+    { "glibc malloc", glibc_create, glibc_destroy, malloc, free, calloc,
+      realloc, glibc_aligned, glibc_footprint },
+};
+
+/*=============================================================================
+* replay
+=============================================================================*/
+// false if the call failed, or was skipped as its block never came to be
+static inline bool run_op(const Allocator& a, const ReplayOp& op,
+                          std::vector<void*>& slots) {
+    void*& slot = slots[op.slot];
+    switch (op.op) {
+    case TRACE_MALLOC:
+        slot = a.alloc(op.size);
+        break;
+    case TRACE_CALLOC:
+        slot = a.zeroed(1, op.size);
+        break;
+    case TRACE_MEMALIGN:
+        slot = a.aligned(op.align, op.size);
+        break;
+    case TRACE_REALLOC: {
+        if (slot == nullptr) return false;
+        void* moved = a.resize(slot, op.size);
+        if (moved == nullptr) return false; // the old block stays
+        slot = moved;
+        break;
+    }
+    case TRACE_FREE:
+        if (slot != nullptr) a.release(slot);
+        slot = nullptr;
+        return true;
+    }
+    if (slot == nullptr) return false;
+    memset(slot, 0, std::min(op.size, (size_t)8));
+    return true;
+}
+
+static void release_all(const Allocator& a, std::vector<void*>& slots) {
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i] != nullptr) a.release(slots[i]);
+        slots[i] = nullptr;
+    }
+}
+
+// the first pass only times the whole trace, the second one times every call
+// and samples the footprint outside the timed calls
+Result replay(const Allocator& a, const Trace& trace) {
+    Result result = {};
+    std::vector<void*> slots(trace.num_slots, nullptr);
+    std::vector<size_t> sizes(trace.num_slots, 0);
+    size_t ops = trace.ops.size();
+
+    a.create();
+    double start = now_seconds();
+    for (size_t i = 0; i < ops; i++) run_op(a, trace.ops[i], slots);
+    result.ops_per_sec = ops / (now_seconds() - start);
+    release_all(a, slots);
+    a.destroy();
+
+    a.create();
+    result.latencies.resize(ops);
+    size_t requested = 0;
+    for (size_t i = 0; i < ops; i++) {
+        const ReplayOp& op = trace.ops[i];
+        timespec before, after;
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        bool done = run_op(a, op, slots);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        result.latencies[i] = (after.tv_sec - before.tv_sec) * 1e9 +
+                              (after.tv_nsec - before.tv_nsec);
+
+        // a failed call leaves the slot, and its size, as they were
+        if (done) {
+            requested -= sizes[op.slot];
+            sizes[op.slot] = slots[op.slot] == nullptr ? 0 : op.size;
+            requested += sizes[op.slot];
+        }
+
+        if (i % FOOTPRINT_INTERVAL == 0 || i == ops - 1) {
+            size_t footprint = a.footprint();
+            if (footprint > result.peak_footprint) {
+                result.peak_footprint = footprint;
+                result.peak_requested = requested;
+            }
+        }
+    }
+    release_all(a, slots);
+    a.destroy();
+
+    std::sort(result.latencies.begin(), result.latencies.end());
+    return result;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1));
+    return sorted[index];
+}
+
+void print_result(const Allocator& a, const Result& r) {
+    const std::vector<double>& l = r.latencies;
+    double fragmentation = r.peak_footprint == 0 ? 0 :
+        1.0 - (double)r.peak_requested / r.peak_footprint;
+
+    std::cout << a.name << std::endl
+              << "  " << (long)r.ops_per_sec << " ops/sec" << std::endl
+              << "  latency ns: p50 " << percentile(l, 50)
+              << ", p90 " << percentile(l, 90)
+              << ", p99 " << percentile(l, 99)
+              << ", p99.9 " << percentile(l, 99.9)
+              << ", max " << (l.empty() ? 0 : l.back()) << std::endl
+              << "  peak heap: " << r.peak_footprint / 1024 << " KB, "
+              << "fragmentation: " << (int)(fragmentation * 100) << "%"
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    Trace trace;
+    if (argc > 1) {
+        if (!load_trace(argv[1], trace)) return 1;
+        std::cout << "=== Replaying " << argv[1] << ": ";
+    } else {
+        build_synthetic_trace(trace);
+        std::cout << "=== Replaying a synthetic trace: ";
+    }
+    std::cout << trace.ops.size() << " ops, " << trace.num_slots
+              << " slots ===" << std::endl;
+
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        print_result(allocators[i], replay(allocators[i], trace));
+    }
+    return 0;
+}
@@ -1,7 +1,17 @@
 #include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <new>
+#include <string>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include "customAllocator.h"
 
 #define MY_ASSERT(condition) \
@@ -87,6 +97,24 @@ void test_error_handling() {
     std::cout << "--- End Error Messages ---" << std::endl;
 }
 
+// pointers into the middle of a block and freed blocks must be rejected
+// without touching the heap
+void test_invalid_pointer_free() {
+    void* p1 = customMalloc(64);
+    void* p2 = customMalloc(64);
+    memset(p2, 0x5, 64);
+
+    std::cout << std::endl << "--- Expect Error Messages Below ---" << std::endl;
+    customFree((char*)p1 + 8);
+    customFree(p1);
+    customFree(p1);
+    MY_ASSERT(customRealloc(p1, 10) == nullptr);
+    std::cout << "--- End Error Messages ---" << std::endl;
+
+    MY_ASSERT(((char*)p2)[63] == 0x5);
+    customFree(p2);
+}
+
 // test if freed block is reused
 void test_reuse_block() {
     size_t size = 100;
@@ -138,6 +166,76 @@ void test_release_to_os() {
 }
 
 
+// large requests are mapped on their own and never move the break
+void test_large_allocation() {
+    void* start_brk = get_program_break();
+
+    char* ptr = (char*)customMalloc(DEFAULT_MMAP_THRESHOLD);
+    MY_ASSERT(ptr != nullptr);
+    MY_ASSERT(get_program_break() == start_brk);
+    memset(ptr, 0x3, DEFAULT_MMAP_THRESHOLD);
+
+    ptr = (char*)customRealloc(ptr, 4 * DEFAULT_MMAP_THRESHOLD);
+    MY_ASSERT(ptr != nullptr);
+    MY_ASSERT(ptr[DEFAULT_MMAP_THRESHOLD - 1] == 0x3);
+    ptr[4 * DEFAULT_MMAP_THRESHOLD - 1] = 0x4;
+
+    customFree(ptr);
+    MY_ASSERT(get_program_break() == start_brk);
+
+    // its header went with the mapping, a second free must not read it
+    std::cout << std::endl << "--- Expect Error Messages Below ---" << std::endl;
+    customFree(ptr);
+    MY_ASSERT(customRealloc(ptr, 10) == nullptr);
+    std::cout << "--- End Error Messages ---" << std::endl;
+
+    // many at once, freed in an order that shifts registry entries around
+    const int COUNT = 600;
+    static void* large[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        large[i] = customMalloc(DEFAULT_MMAP_THRESHOLD);
+        MY_ASSERT(large[i] != nullptr);
+    }
+    for (int i = 0; i < COUNT; i += 2) customFree(large[i]);
+    for (int i = 1; i < COUNT; i += 2) {
+        large[i] = customRealloc(large[i], 2 * DEFAULT_MMAP_THRESHOLD);
+        MY_ASSERT(large[i] != nullptr);
+    }
+    MallocStats stats;
+    customMallocStats(&stats);
+    MY_ASSERT(stats.large_blocks == COUNT / 2);
+    for (int i = 1; i < COUNT; i += 2) customFree(large[i]);
+    customMallocStats(&stats);
+    MY_ASSERT(stats.large_blocks == 0);
+}
+
+// sizes that wrap around when rounded fail, on both heaps
+void test_huge_requests() {
+    heapMTCreate();
+    size_t sizes[] = {SIZE_MAX, SIZE_MAX - 8, (size_t)PTRDIFF_MAX + 1};
+    for (size_t size : sizes) {
+        MY_ASSERT(customMalloc(size) == nullptr);
+        MY_ASSERT(customAlignedAlloc(64, size) == nullptr);
+        MY_ASSERT(customMTMalloc(size) == nullptr);
+        MY_ASSERT(customMTAlignedAlloc(64, size) == nullptr);
+        void* batch[4];
+        MY_ASSERT(customMTMallocBatch(size, 4, batch) == 0);
+
+        char* ptr = (char*)customMalloc(100);
+        ptr[99] = 0x5;
+        MY_ASSERT(customRealloc(ptr, size) == nullptr);
+        MY_ASSERT(ptr[99] == 0x5);
+        customFree(ptr);
+
+        ptr = (char*)customMTMalloc(100);
+        ptr[99] = 0x6;
+        MY_ASSERT(customMTRealloc(ptr, size) == nullptr);
+        MY_ASSERT(ptr[99] == 0x6);
+        customMTFree(ptr);
+    }
+    heapMTKill();
+}
+
 void test_realloc_split() {
     void* ptr = customMalloc(1000);
     void* original_addr = ptr;
@@ -153,6 +251,389 @@ void test_realloc_split() {
     customFree(ptr2);
 }
 
+// the last block grows with the break, and a block between two free ones
+// takes in both, without a copy to a new block
+void test_realloc_in_place() {
+    char* top = (char*)customMalloc(1000);
+    memset(top, 0x3, 1000);
+    for (size_t size = 2000; size <= 64000; size *= 2) {
+        MY_ASSERT(customRealloc(top, size) == top);
+    }
+    MY_ASSERT(top[0] == 0x3 && top[999] == 0x3);
+
+    void* a = customMalloc(200);
+    char* b = (char*)customMalloc(200);
+    void* c = customMalloc(200);
+    void* guard = customMalloc(200);
+    memset(b, 0x4, 200);
+    customFree(a);
+    customFree(c);
+
+    char* grown = (char*)customRealloc(b, 550);
+    MY_ASSERT(grown == a);
+    MY_ASSERT(grown[0] == 0x4 && grown[199] == 0x4);
+
+    customFree(grown);
+    customFree(guard);
+    customFree(top);
+    heapKill();
+}
+
+static bool all_zero(void* ptr, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (((char*)ptr)[i] != 0) return false;
+    }
+    return true;
+}
+
+// calloc skips the memset only where memory is known to be zero: a lowered
+// and raised break keeps the old bytes of its page, reused blocks keep theirs
+void test_calloc_zeroing() {
+    std::cout << std::endl << "--- Expect Error Messages Below ---" << std::endl;
+    MY_ASSERT(customCalloc((size_t)-1 / 2, 3) == nullptr);
+    std::cout << "--- End Error Messages ---" << std::endl;
+
+    void* guard = customMalloc(100);
+    void* top = customMalloc(10000);
+    memset(top, 0xFF, 10000);
+    customFree(top); // the break goes down to mid page, that page stays
+    void* fresh = customCalloc(1, 10000);
+    MY_ASSERT(fresh == top);
+    MY_ASSERT(all_zero(fresh, 10000));
+
+    void* guard2 = customMalloc(100);
+    memset(fresh, 0xFF, 10000);
+    customFree(fresh);
+    void* reused = customCalloc(10, 1000);
+    MY_ASSERT(reused == fresh);
+    MY_ASSERT(all_zero(reused, 10000));
+
+    void* large = customCalloc(1024, 1024);
+    MY_ASSERT(all_zero(large, 1024 * 1024));
+
+    customFree(large);
+    customFree(reused);
+    customFree(guard2);
+    customFree(guard);
+    heapKill();
+
+    heapMTCreate();
+    MY_ASSERT(customMTCalloc((size_t)-1 / 2, 3) == nullptr);
+    void* block = customMTMalloc(3000);
+    memset(block, 0xFF, 3000);
+    customMTFree(block);
+    void* zeroed = customMTCalloc(3, 1000);
+    MY_ASSERT(all_zero(zeroed, 3000));
+    void* mapped = customMTCalloc(1024, 1024);
+    MY_ASSERT(all_zero(mapped, 1024 * 1024));
+    customMTFree(zeroed);
+    customMTFree(mapped);
+    heapMTKill();
+}
+
+// regions bump through their chunks and start over on reset
+void test_region() {
+    Region* region = regionCreate(4096, false);
+    MY_ASSERT(region != nullptr);
+
+    char* first = (char*)regionAlloc(region, 24);
+    char* second = (char*)regionAlloc(region, 24);
+    MY_ASSERT((size_t)first % CUSTOM_ALIGNMENT == 0);
+    MY_ASSERT(second - first == (long)ALIGN_UP(24, CUSTOM_ALIGNMENT));
+
+    // past the first chunk, and one request bigger than a chunk
+    for (int i = 0; i < 500; i++) {
+        char* ptr = (char*)regionAlloc(region, 40);
+        MY_ASSERT(ptr != nullptr);
+        memset(ptr, 0x7, 40);
+    }
+    char* big = (char*)regionAlloc(region, 10000);
+    memset(big, 0x8, 10000);
+    MY_ASSERT(regionAlloc(region, 0) == nullptr);
+    MY_ASSERT(regionAlloc(region, SIZE_MAX) == nullptr);
+    MY_ASSERT(regionAlloc(region, SIZE_MAX - 8) == nullptr);
+    MY_ASSERT(regionCreate(SIZE_MAX, false) == nullptr);
+
+    regionReset(region);
+    MY_ASSERT(regionAlloc(region, 24) == first);
+    regionDestroy(region);
+    heapKill();
+
+    heapMTCreate();
+    Region* mt_region = regionCreate(0, true);
+    for (int i = 0; i < 5000; i++) MY_ASSERT(regionAlloc(mt_region, 100));
+    regionReset(mt_region);
+    regionDestroy(mt_region);
+    heapMTKill();
+}
+
+// blocks pay only the 16 byte header
+void test_compact_header() {
+    MY_ASSERT(sizeof(Block) == 16);
+
+    void* p1 = customMalloc(80);
+    void* p2 = customMalloc(80);
+    MY_ASSERT((char*)p2 - (char*)p1 == 80 + 16);
+
+    customFree(p1);
+    customFree(p2);
+}
+
+// test that the size class lists pick the tightest hole, not the first one
+void test_best_fit_size_classes() {
+    void* big_hole = customMalloc(600);
+    void* sep1 = customMalloc(100);
+    void* small_hole = customMalloc(300);
+    void* sep2 = customMalloc(100);
+
+    customFree(big_hole);
+    customFree(small_hole);
+
+    void* p1 = customMalloc(290);
+    MY_ASSERT(p1 == small_hole);
+    void* p2 = customMalloc(590);
+    MY_ASSERT(p2 == big_hole);
+
+    customFree(p1);
+    customFree(p2);
+    customFree(sep1);
+    customFree(sep2);
+}
+
+// objects up to SLAB_MAX_SIZE are packed without headers and checked on free
+void test_slab_small_objects() {
+    void* objects[100];
+    for (int i = 0; i < 100; i++) {
+        objects[i] = customMalloc(20);
+        memset(objects[i], i, 20);
+    }
+    for (int i = 1; i < 100; i++) {
+        MY_ASSERT((char*)objects[i] - (char*)objects[i - 1] == 32);
+    }
+
+    std::cout << std::endl << "--- Expect Error Messages Below ---" << std::endl;
+    customFree((char*)objects[5] + 8);
+    customFree(objects[6]);
+    customFree(objects[6]);
+    std::cout << "--- End Error Messages ---" << std::endl;
+
+    // freed slots are handed out again, neighbours are untouched
+    MY_ASSERT(customMalloc(30) == objects[6]);
+    MY_ASSERT(((char*)objects[5])[19] == 5 && ((char*)objects[7])[0] == 7);
+
+    // growing past the object size moves out of the slab
+    void* grown = customRealloc(objects[0], 200);
+    MY_ASSERT(grown != objects[0] && ((char*)grown)[19] == 0);
+    objects[0] = grown;
+
+    for (int i = 0; i < 100; i++) customFree(objects[i]);
+
+    heapMTCreate();
+    void* mt1 = customMTMalloc(64);
+    void* mt2 = customMTMalloc(64);
+    MY_ASSERT(mt2 != nullptr && (char*)mt2 - (char*)mt1 == 64);
+    customMTFree(mt1);
+    customMTFree(mt2);
+    heapMTKill();
+}
+
+// every payload is aligned for any type, stricter alignments on request
+void test_aligned_allocation() {
+    size_t sizes[] = { 1, 8, 24, 40, 100, 1000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* p = customMalloc(sizes[i]);
+        MY_ASSERT((size_t)p % alignof(max_align_t) == 0);
+        customFree(p);
+    }
+
+    size_t alignments[] = { 64, 256, 4096 };
+    void* held[3];
+    for (int i = 0; i < 3; i++) {
+        void* sep = customMalloc(100); // moves the heap off any alignment
+        held[i] = customAlignedAlloc(alignments[i], 200);
+        MY_ASSERT(held[i] != nullptr && (size_t)held[i] % alignments[i] == 0);
+        memset(held[i], 0x7, 200);
+        customFree(sep);
+    }
+    MY_ASSERT(customAlignedAlloc(48, 10) == nullptr);
+
+    // the freed separators and cut off pieces did not touch the blocks
+    for (int i = 0; i < 3; i++) {
+        MY_ASSERT(((char*)held[i])[0] == 0x7 && ((char*)held[i])[199] == 0x7);
+        customFree(held[i]);
+    }
+
+    // large ones are mapped like any large block, failing returns nullptr
+    size_t large_alignments[] = { 64, 4096, 2 * 1024 * 1024 };
+    size_t large_size = 64 * 1024 * 1024;
+    void* start_brk = get_program_break();
+    for (int i = 0; i < 3; i++) {
+        char* p = (char*)customAlignedAlloc(large_alignments[i], large_size);
+        MY_ASSERT(p != nullptr && (size_t)p % large_alignments[i] == 0);
+        MY_ASSERT(get_program_break() == start_brk);
+        p[0] = 0x1;
+        p[large_size - 1] = 0x2;
+        p = (char*)customRealloc(p, 2 * large_size);
+        MY_ASSERT(p != nullptr && p[0] == 0x1 && p[large_size - 1] == 0x2);
+        customFree(p);
+    }
+    MallocStats stats;
+    customMallocStats(&stats);
+    MY_ASSERT(stats.large_blocks == 0 && stats.large_bytes == 0);
+    MY_ASSERT(customAlignedAlloc(64, 1ULL << 50) == nullptr);
+    MY_ASSERT(get_program_break() == start_brk);
+
+    heapMTCreate();
+    for (int i = 0; i < 3; i++) {
+        held[i] = customMTAlignedAlloc(alignments[i], 5000);
+        MY_ASSERT(held[i] != nullptr && (size_t)held[i] % alignments[i] == 0);
+        memset(held[i], 0x7, 5000);
+    }
+    void* mt = customMTMalloc(100);
+    MY_ASSERT((size_t)mt % alignof(max_align_t) == 0);
+    customMTFree(mt);
+    for (int i = 0; i < 3; i++) customMTFree(held[i]);
+    heapMTKill();
+}
+
+// deferred coalescing reuses parked blocks as they are and merges them only
+// when a request finds nothing else
+void test_deferred_coalescing() {
+    HeapConfig config = {};
+    config.deferred_coalescing = true;
+    heapCreateEx(&config);
+
+    void* a = customMalloc(100);
+    void* b = customMalloc(100);
+    void* c = customMalloc(100);
+    customFree(b);
+    MY_ASSERT(customMalloc(100) == b);
+
+    customFree(a);
+    customFree(b);
+    customFree(c);
+    std::cout << std::endl << "--- Expect Error Messages Below ---" << std::endl;
+    customFree(b);
+    std::cout << "--- End Error Messages ---" << std::endl;
+
+    // nothing parked fits, so the three merge into one block again
+    void* merged = customMalloc(300);
+    MY_ASSERT(merged == a);
+    customFree(merged);
+    heapKill();
+
+    customMTSetCacheDepth(0);
+    heapMTCreateEx(&config);
+    void* p = customMTMalloc(100);
+    customMTFree(p);
+    MY_ASSERT(customMTMalloc(100) == p);
+    customMTFree(p);
+    heapMTKill();
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+}
+
+// true if the page holding addr is in memory
+bool page_resident(void* addr) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char vec = 0;
+    mincore((void*)((size_t)addr & ~(page - 1)), page, &vec);
+    return vec & 1;
+}
+
+// free memory goes back to the OS from the top of the heap and from the
+// middle of big free blocks
+void test_trim() {
+    void* start_brk = get_program_break();
+
+    // with a threshold the free top is kept until an explicit trim
+    customSetTrimThreshold(64 * 1024);
+    void* top = customMalloc(4000);
+    customFree(top);
+    MY_ASSERT(get_program_break() > start_brk);
+    MY_ASSERT(customTrim(0) == 1);
+    MY_ASSERT(get_program_break() == start_brk);
+    customSetTrimThreshold(DEFAULT_TRIM_THRESHOLD);
+
+    // interior blocks: a big one is advised on free, a smaller one on trim
+    const int COUNT = 160;
+    char* blocks[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = (char*)customMalloc(8 * 1024);
+        memset(blocks[i], 0x1, 8 * 1024);
+    }
+    void* guard = customMalloc(100);
+    for (int i = 0; i < COUNT; i++) customFree(blocks[i]);
+    MY_ASSERT(!page_resident(blocks[COUNT / 2]));
+
+    char* medium = (char*)customMalloc(64 * 1024);
+    void* guard2 = customMalloc(100);
+    memset(medium, 0x1, 64 * 1024);
+    customFree(medium);
+    MY_ASSERT(page_resident(medium + 32 * 1024));
+    MY_ASSERT(customTrim(0) == 1);
+    MY_ASSERT(!page_resident(medium + 32 * 1024));
+    customFree(guard);
+    customFree(guard2);
+
+    heapMTCreate();
+    char* mt = (char*)customMTMalloc(64 * 1024);
+    void* mt_guard = customMTMalloc(100);
+    memset(mt, 0x1, 64 * 1024);
+    customMTFree(mt);
+    MY_ASSERT(customMTTrim() == 1);
+    MY_ASSERT(!page_resident(mt + 32 * 1024));
+    customMTFree(mt_guard);
+    heapMTKill();
+}
+
+// reads back what a stats dump wrote
+std::string dump_to_string(void (*dump)(int, bool), bool json) {
+    FILE* file = tmpfile();
+    dump(fileno(file), json);
+    rewind(file);
+    std::string text;
+    char buf[512];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) text.append(buf, n);
+    fclose(file);
+    return text;
+}
+
+// the statistics match what the heap holds
+void test_malloc_stats() {
+    heapKill();
+    void* freed = customMalloc(100);
+    void* live = customMalloc(200);
+    void* small = customMalloc(16);
+    customFree(freed);
+
+    MallocStats stats;
+    customMallocStats(&stats);
+    MY_ASSERT(stats.live_blocks == 1 && stats.live_bytes == 208);
+    MY_ASSERT(stats.free_blocks == 1 && stats.free_bytes == 112);
+    MY_ASSERT(stats.largest_free == 112);
+    MY_ASSERT(stats.header_bytes == 3 * sizeof(Block));
+    MY_ASSERT(stats.slab_classes[0].live_objects == 1);
+    MY_ASSERT(stats.sbrk_calls > 0);
+
+    std::string text = dump_to_string(customMallocStatsDump, false);
+    MY_ASSERT(text.find("live_bytes: 208") != std::string::npos);
+    customFree(live);
+    customFree(small);
+
+    heapMTCreate();
+    void* mt = customMTMalloc(1000);
+    AreaStats areas[NUM_AREAS];
+    MY_ASSERT(customMTMallocStats(&stats, areas, NUM_AREAS) == NUM_AREAS);
+    MY_ASSERT(stats.live_blocks == 1 && stats.live_bytes == 1008);
+    MY_ASSERT(stats.lock_acquisitions > 0);
+
+    std::string json = dump_to_string(customMTMallocStatsDump, true);
+    MY_ASSERT(json[0] == '{' && json.find("\"areas\": [") != std::string::npos);
+    customMTFree(mt);
+    heapMTKill();
+}
+
 // part B tests - MT
 
 struct ThreadData {
@@ -251,7 +732,572 @@ void test_mt_contention() {
     heapMTKill();
 }
 
-int main() {
+#define LOCK_THREADS 8
+#define LOCK_ROUNDS 5000
+
+void* area_lock_task(void* arg) {
+    long id = (long)arg;
+    for (int i = 0; i < LOCK_ROUNDS; i++) {
+        long* block = (long*)customMTMalloc(100 + (i % 4) * 100);
+        *block = id;
+        if (*block != id) return (void*)1;
+        customMTFree(block);
+    }
+    return nullptr;
+}
+
+// every thread works in the one area with the thread cache off, so each
+// malloc and free takes its lock. the acquisition counter is a plain
+// increment made under the lock and would lose counts without exclusion.
+void test_mt_area_locks() {
+    for (int mutex = 0; mutex < 2; mutex++) {
+        HeapConfig config = { 1, 64 * 1024, DEFAULT_MAX_AREA_SIZE, false,
+                              false, false, mutex == 1 };
+        customMTSetCacheDepth(0);
+        heapMTCreateEx(&config);
+
+        pthread_t threads[LOCK_THREADS];
+        for (long i = 0; i < LOCK_THREADS; i++) {
+            pthread_create(&threads[i], nullptr, area_lock_task, (void*)i);
+        }
+        for (int i = 0; i < LOCK_THREADS; i++) {
+            void* result;
+            pthread_join(threads[i], &result);
+            MY_ASSERT(result == nullptr);
+        }
+
+        MallocStats stats;
+        customMTMallocStats(&stats, nullptr, 0);
+        MY_ASSERT(stats.num_areas == 1);
+        MY_ASSERT(stats.lock_acquisitions == 2 * LOCK_THREADS * LOCK_ROUNDS);
+        heapMTKill();
+        customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+    }
+}
+
+// a freed small block comes straight back from the thread cache, and the
+// heap keeps working with the cache turned off
+void test_mt_thread_cache() {
+    heapMTCreate();
+
+    void* p1 = customMTMalloc(40);
+    MY_ASSERT(p1 != nullptr);
+    customMTFree(p1);
+    void* p2 = customMTMalloc(40);
+    MY_ASSERT(p2 == p1);
+    customMTFree(p2);
+
+    customMTSetCacheDepth(0);
+    void* p3 = customMTMalloc(40);
+    MY_ASSERT(p3 != nullptr);
+    memset(p3, 0x7, 40);
+    customMTFree(p3);
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+
+    heapMTKill();
+}
+
+// consecutive allocations of one thread come from its home area
+void test_mt_home_area() {
+    heapMTCreate();
+
+    char* p1 = (char*)customMTMalloc(600);
+    char* p2 = (char*)customMTMalloc(600);
+    MY_ASSERT(p1 != nullptr && p2 != nullptr);
+    long diff = p2 - p1;
+    MY_ASSERT(diff > 0 && diff < AREA_SIZE);
+
+    customMTFree(p1);
+    customMTFree(p2);
+    heapMTKill();
+}
+
+// requests bigger than an area used to fail in the MT heap
+void test_mt_large_allocation() {
+    heapMTCreate();
+
+    char* ptr = (char*)customMTMalloc(3 * AREA_SIZE);
+    MY_ASSERT(ptr != nullptr);
+    memset(ptr, 0x6, 3 * AREA_SIZE);
+
+    ptr = (char*)customMTRealloc(ptr, 64 * AREA_SIZE);
+    MY_ASSERT(ptr != nullptr);
+    MY_ASSERT(ptr[3 * AREA_SIZE - 1] == 0x6);
+
+    customMTFree(ptr);
+    heapMTKill();
+}
+
+// areas follow the configured size and later ones grow to fit the load
+void test_mt_configured_heap() {
+    HeapConfig config = { 2, 64 * 1024, 1024 * 1024 };
+    heapMTCreateEx(&config);
+
+    // fits an initial area
+    char* first = (char*)customMTMalloc(40 * 1024);
+    MY_ASSERT(first != nullptr);
+    memset(first, 0x1, 40 * 1024);
+
+    // far more than the initial areas hold
+    const int COUNT = 200;
+    void* blocks[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = customMTMalloc(8 * 1024);
+        MY_ASSERT(blocks[i] != nullptr);
+        memset(blocks[i], i, 8 * 1024);
+    }
+    for (int i = 0; i < COUNT; i++) {
+        MY_ASSERT(((unsigned char*)blocks[i])[8 * 1024 - 1] == (unsigned char)i);
+        customMTFree(blocks[i]);
+    }
+
+    MY_ASSERT(first[40 * 1024 - 1] == 0x1);
+    customMTFree(first);
+    heapMTKill();
+}
+
+// every thread keeps missing the existing areas, so they all publish new
+// ones at the same time
+void* growth_task(void* arg) {
+    ThreadData* data = (ThreadData*)arg;
+    data->success = true;
+    void* blocks[50];
+
+    for (int i = 0; i < 50; i++) {
+        blocks[i] = customMTMalloc(2048);
+        if (blocks[i] == nullptr) {
+            data->success = false;
+            return nullptr;
+        }
+        memset(blocks[i], data->id, 2048);
+    }
+    for (int i = 0; i < 50; i++) {
+        if (((char*)blocks[i])[2047] != (char)data->id) data->success = false;
+        customMTFree(blocks[i]);
+    }
+    return nullptr;
+}
+
+// an area whose mmap fails takes no id, so more failures than there are ids
+// still leave the heap able to grow once memory is back
+void test_mt_failed_areas() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        heapMTCreate();
+        customMTFree(customMTMalloc(100));
+
+        struct rlimit limit;
+        getrlimit(RLIMIT_AS, &limit);
+        struct rlimit tight = limit;
+        long pages = 0;
+        FILE* statm = fopen("/proc/self/statm", "r");
+        if (statm == nullptr || fscanf(statm, "%ld", &pages) != 1) _exit(2);
+        fclose(statm);
+        tight.rlim_cur = pages * sysconf(_SC_PAGESIZE) + 64 * 1024;
+        setrlimit(RLIMIT_AS, &tight);
+
+        int failures = 0;
+        for (int i = 0; i < MAX_AREAS + 100; i++) {
+            if (customMTMalloc(100 * 1024) == nullptr) failures++;
+        }
+        setrlimit(RLIMIT_AS, &limit);
+
+        void* ptr = customMTMalloc(100 * 1024);
+        _exit(failures > MAX_AREAS && ptr != nullptr ? 0 : 1);
+    }
+
+    int status = 0;
+    MY_ASSERT(pid > 0 && waitpid(pid, &status, 0) == pid);
+    MY_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void test_mt_concurrent_growth() {
+    HeapConfig config = { 1, AREA_SIZE, 2 * AREA_SIZE };
+    heapMTCreateEx(&config);
+
+    const int NUM_THREADS = 8;
+    pthread_t threads[NUM_THREADS];
+    ThreadData tdata[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        tdata[i].id = i + 1;
+        pthread_create(&threads[i], nullptr, growth_task, &tdata[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(threads[i], nullptr);
+        MY_ASSERT(tdata[i].success == true);
+    }
+
+    heapMTKill();
+}
+
+// in per CPU mode every CPU starts with its own area, and threads growing
+// the heap move their CPU's area along
+void test_mt_per_cpu_areas() {
+    HeapConfig config = { 1, AREA_SIZE, 4 * AREA_SIZE, false, true };
+    heapMTCreateEx(&config);
+
+    MallocStats stats;
+    customMTMallocStats(&stats, nullptr, 0);
+    MY_ASSERT(stats.num_areas >= (size_t)sysconf(_SC_NPROCESSORS_CONF));
+
+    const int NUM_THREADS = 8;
+    pthread_t threads[NUM_THREADS];
+    ThreadData tdata[NUM_THREADS];
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        tdata[i].id = i + 1;
+        pthread_create(&threads[i], nullptr, growth_task, &tdata[i]);
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(threads[i], nullptr);
+        MY_ASSERT(tdata[i].success == true);
+    }
+
+    heapMTKill();
+}
+
+// a CPU whose area is full borrows from other areas but keeps its own, so
+// space freed there is used again before the borrowed area
+void test_mt_per_cpu_steal() {
+    cpu_set_t saved, pinned;
+    sched_getaffinity(0, sizeof(saved), &saved);
+    CPU_ZERO(&pinned);
+    CPU_SET(sched_getcpu(), &pinned);
+    sched_setaffinity(0, sizeof(pinned), &pinned);
+
+    HeapConfig config = { 2, AREA_SIZE, AREA_SIZE, false, true };
+    heapMTCreateEx(&config);
+    customMTSetCacheDepth(0);
+
+    // the areas made up front go to the CPUs in order, fill this CPU's
+    static AreaStats areas[MAX_CPU_AREAS + 8];
+    MallocStats stats;
+    customMTMallocStats(&stats, areas, MAX_CPU_AREAS + 8);
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    int cpu = sched_getcpu() % (cpus < MAX_CPU_AREAS ? cpus : MAX_CPU_AREAS);
+    size_t own_live = areas[cpu].live_blocks;
+
+    const int COUNT = 8;
+    void* blocks[COUNT];
+    int own = -1;
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = customMTMalloc(1000);
+        MY_ASSERT(blocks[i] != nullptr);
+        customMTMallocStats(&stats, areas, MAX_CPU_AREAS + 8);
+        if (areas[cpu].live_blocks > own_live) own = i;
+        own_live = areas[cpu].live_blocks;
+    }
+    MY_ASSERT(own >= 0 && own < COUNT - 1);
+
+    customMTFree(blocks[own]);
+    customMTMallocStats(&stats, areas, MAX_CPU_AREAS + 8);
+    size_t before = areas[cpu].live_blocks;
+    blocks[own] = customMTMalloc(1000);
+    customMTMallocStats(&stats, areas, MAX_CPU_AREAS + 8);
+    MY_ASSERT(areas[cpu].live_blocks == before + 1);
+
+    for (int i = 0; i < COUNT; i++) customMTFree(blocks[i]);
+    customMTSetCacheDepth(TCACHE_DEFAULT_DEPTH);
+    heapMTKill();
+    sched_setaffinity(0, sizeof(saved), &saved);
+}
+
+// huge page areas come in whole huge pages and work like any other
+void test_mt_huge_pages() {
+    HeapConfig config = { 2, AREA_SIZE, DEFAULT_MAX_AREA_SIZE, false, false,
+                          true };
+    heapMTCreateEx(&config);
+
+    // more than the two areas made up front hold
+    const int COUNT = 3000;
+    static void* blocks[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = customMTMalloc(2000);
+        MY_ASSERT(blocks[i] != nullptr);
+        memset(blocks[i], i & 0xFF, 2000);
+    }
+
+    MallocStats stats;
+    AreaStats areas[64];
+    size_t count = customMTMallocStats(&stats, areas, 64);
+    MY_ASSERT(count > 2);
+    for (size_t i = 0; i < count && i < 64; i++) {
+        MY_ASSERT(areas[i].size % HUGE_PAGE_SIZE == 0);
+    }
+
+    for (int i = 0; i < COUNT; i++) {
+        MY_ASSERT(((unsigned char*)blocks[i])[1999] == (unsigned char)(i & 0xFF));
+        customMTFree(blocks[i]);
+    }
+    heapMTKill();
+}
+
+void* remote_free_task(void* arg) {
+    void** blocks = (void**)arg;
+    for (int i = 0; i < 3; i++) customMTFree(blocks[i]);
+    return nullptr;
+}
+
+// blocks freed by another thread come back to the owner's area on its next
+// malloc and merge there
+void test_mt_remote_free() {
+    heapMTCreate();
+
+    void* blocks[3];
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = customMTMalloc(1000);
+        MY_ASSERT(blocks[i] != nullptr);
+    }
+
+    pthread_t consumer;
+    pthread_create(&consumer, nullptr, remote_free_task, blocks);
+    pthread_join(consumer, nullptr);
+
+    void* merged = customMTMalloc(3000);
+    MY_ASSERT(merged == blocks[0]);
+
+    customMTFree(merged);
+    heapMTKill();
+}
+
+// MT realloc also grows into both free neighbours
+void test_mt_realloc_into_neighbours() {
+    heapMTCreate();
+
+    void* blocks[4];
+    for (int i = 0; i < 4; i++) blocks[i] = customMTMalloc(1000);
+    memset(blocks[1], 0x6, 1000);
+    customMTFree(blocks[0]);
+    customMTFree(blocks[2]);
+
+    char* grown = (char*)customMTRealloc(blocks[1], 2500);
+    MY_ASSERT(grown == blocks[0]);
+    MY_ASSERT(grown[0] == 0x6 && grown[999] == 0x6);
+
+    customMTFree(grown);
+    customMTFree(blocks[3]);
+    heapMTKill();
+}
+
+// a batch is cut in one run from an area and given back in one pass
+void test_mt_batch() {
+    heapMTCreate();
+    static void* nodes[2000];
+
+    MY_ASSERT(customMTMallocBatch(200, 2000, nodes) == 2000);
+    for (int i = 0; i < 2000; i++) memset(nodes[i], i & 0xFF, 200);
+    for (int i = 1; i < 2000; i++) {
+        MY_ASSERT(((char*)nodes[i - 1])[199] == (char)((i - 1) & 0xFF));
+    }
+    MY_ASSERT((char*)nodes[1] - (char*)nodes[0] ==
+              (long)(ALIGN_UP(200, CUSTOM_ALIGNMENT) + sizeof(Block)));
+    customMTFreeBatch(nodes, 2000);
+
+    MY_ASSERT(customMTMallocBatch(40, 500, nodes) == 500);
+    nodes[500] = nullptr;
+    customMTFreeBatch(nodes, 501);
+
+    MallocStats stats;
+    customMTMallocStats(&stats, nullptr, 0);
+    MY_ASSERT(stats.live_blocks == 0);
+    heapMTKill();
+}
+
+void test_mt_usable_size() {
+    heapMTCreate();
+
+    size_t sizes[] = { 1, 40, 1000, 256 * 1024 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* ptr = customMTMalloc(sizes[i]);
+        MY_ASSERT(customMTUsableSize(ptr) >= sizes[i]);
+        memset(ptr, 0xAB, customMTUsableSize(ptr));
+        customMTFree(ptr);
+    }
+    void* aligned = customMTAlignedAlloc(256, 300);
+    MY_ASSERT(customMTUsableSize(aligned) >= 300);
+    customMTFree(aligned);
+    MY_ASSERT(customMTUsableSize(nullptr) == 0);
+
+    heapMTKill();
+}
+
+// sized frees of slab objects, blocks and mappings on both heaps give the
+// memory back like plain frees
+void test_sized_free() {
+    size_t sizes[] = { 24, 1000, 256 * 1024 };
+    MallocStats stats;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* ptr = customMalloc(sizes[i]);
+        memset(ptr, 0xAB, sizes[i]);
+        customFreeSized(ptr, sizes[i]);
+        if (i < 2) MY_ASSERT(customMalloc(sizes[i]) == ptr);
+    }
+    customMallocStats(&stats);
+    MY_ASSERT(stats.large_blocks == 0);
+    heapKill();
+
+    heapMTCreate();
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        void* ptr = customMTMalloc(sizes[i]);
+        memset(ptr, 0xAB, sizes[i]);
+        customMTFreeSized(ptr, sizes[i]);
+        if (i < 2) MY_ASSERT(customMTMalloc(sizes[i]) == ptr);
+    }
+    void* aligned = customMTAlignedAlloc(256, 40);
+    customMTFreeSized(aligned, 40);
+    customMTFreeSized(nullptr, 8);
+    customMTMallocStats(&stats, nullptr, 0);
+    MY_ASSERT(stats.large_blocks == 0);
+    heapMTKill();
+}
+
+// writes a heap profile to a temporary file and returns its text
+std::string heap_profile(bool pprof) {
+    FILE* file = tmpfile();
+    customHeapProfileDump(fileno(file), pprof);
+    rewind(file);
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) text.append(buf, n);
+    fclose(file);
+    return text;
+}
+
+// with a rate of one byte every allocation is sampled until it is freed
+void test_heap_profile() {
+    heapMTCreate();
+    customSetProfileRate(1);
+    customMTFree(customMTMalloc(100)); // the thread starts counting
+
+    void* blocks[10];
+    for (int i = 0; i < 10; i++) blocks[i] = customMTMalloc(1000);
+    for (int i = 0; i < 5; i++) customMTFree(blocks[i]);
+    blocks[5] = customMTRealloc(blocks[5], 3000);
+    MY_ASSERT(customMalloc(500) != nullptr);
+
+    std::string text = heap_profile(false);
+    MY_ASSERT(text.find("sampled_objects: 6\n") != std::string::npos);
+    MY_ASSERT(text.find("sampled_bytes: 7500\n") != std::string::npos);
+    MY_ASSERT(text.find("3000 bytes, about 3000 live") != std::string::npos);
+
+    std::string profile = heap_profile(true);
+    MY_ASSERT(profile.find("heap profile: 6: 7500 [ 6: 7500] @ heap_v2/1\n")
+              == 0);
+    MY_ASSERT(profile.find("1: 1000 [ 1: 1000] @ 0x") != std::string::npos);
+    MY_ASSERT(profile.find("MAPPED_LIBRARIES:") != std::string::npos);
+
+    // killing a heap drops its samples, freeing drops the rest
+    customSetProfileRate(0);
+    heapKill();
+    MY_ASSERT(heap_profile(false).find("sampled_objects: 5\n") == 0);
+    for (int i = 5; i < 10; i++) customMTFree(blocks[i]);
+    MY_ASSERT(heap_profile(false).find("sampled_objects: 0\n") == 0);
+    heapMTKill();
+}
+
+// aligned and batch allocations are sampled like any other, once each
+void test_heap_profile_aligned() {
+    heapMTCreate();
+    customSetProfileRate(1);
+    customMTFree(customMTMalloc(100)); // the thread starts counting
+
+    void* aligned = customAlignedAlloc(256, 700);
+    void* mt_aligned = customMTAlignedAlloc(4096, 900);
+    void* small = customMTAlignedAlloc(8, 40);
+    void* batch[4];
+    MY_ASSERT(customMTMallocBatch(200, 4, batch) == 4);
+
+    std::string text = heap_profile(false);
+    MY_ASSERT(text.find("sampled_objects: 7\n") == 0);
+    MY_ASSERT(text.find("sampled_bytes: 2440\n") != std::string::npos);
+    MY_ASSERT(text.find("700 bytes, about 700 live") != std::string::npos);
+    MY_ASSERT(text.find("900 bytes, about 900 live") != std::string::npos);
+
+    customSetProfileRate(0);
+    customFree(aligned);
+    customMTFree(mt_aligned);
+    customMTFree(small);
+    customMTFreeBatch(batch, 4);
+    MY_ASSERT(heap_profile(false).find("sampled_objects: 0\n") == 0);
+    heapKill();
+    heapMTKill();
+}
+
+// the child of a fork made between the handlers can use the heap it inherits
+void test_mt_fork() {
+    heapMTCreate();
+    void* before = customMTMalloc(1000);
+
+    heapMTForkPrepare();
+    pid_t pid = fork();
+    if (pid == 0) {
+        heapMTForkChild();
+        void* ptr = customMTMalloc(2000);
+        customMTFree(before);
+        customMTFree(ptr);
+        _exit(customMTMalloc(24) != nullptr ? 0 : 1);
+    }
+    heapMTForkParent();
+
+    int status = 0;
+    MY_ASSERT(pid > 0 && waitpid(pid, &status, 0) == pid);
+    MY_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    customMTFree(before);
+    heapMTKill();
+}
+
+// what "my_tests preload-huge" runs under libcustommalloc.so: the malloc
+// family fails sizes too large to round with ENOMEM, new throws
+void preload_huge_requests() {
+    volatile size_t sizes[] = {SIZE_MAX, SIZE_MAX - 8, (size_t)PTRDIFF_MAX + 1};
+    void* ptr = malloc(100);
+    MY_ASSERT(ptr != nullptr);
+    for (size_t size : sizes) {
+        errno = 0;
+        MY_ASSERT(malloc(size) == nullptr && errno == ENOMEM);
+        errno = 0;
+        MY_ASSERT(calloc(1, size) == nullptr && errno == ENOMEM);
+        errno = 0;
+        MY_ASSERT(realloc(ptr, size) == nullptr && errno == ENOMEM);
+        errno = 0;
+        MY_ASSERT(aligned_alloc(64, size) == nullptr && errno == ENOMEM);
+        void* aligned = nullptr;
+        MY_ASSERT(posix_memalign(&aligned, 64, size) == ENOMEM);
+        MY_ASSERT(operator new(size, std::nothrow) == nullptr);
+    }
+    free(ptr);
+}
+
+// the drop-in malloc, run in a child that preloads it
+void test_preload_huge_requests() {
+    if (access("./libcustommalloc.so", R_OK) != 0) {
+        std::cout << "SKIPPED (no ./libcustommalloc.so, make builds it) ";
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("LD_PRELOAD", "./libcustommalloc.so", 1);
+        execl("/proc/self/exe", "my_tests", "preload-huge", (char*)nullptr);
+        _exit(2);
+    }
+
+    int status = 0;
+    MY_ASSERT(pid > 0 && waitpid(pid, &status, 0) == pid);
+    MY_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "preload-huge") == 0) {
+        preload_huge_requests();
+        return 0;
+    }
+
+
     std::cout << "=== Starting Basic Tests ===" << std::endl;
     
     // Part A
@@ -260,6 +1306,7 @@ int main() {
     RUN_TEST(test_split_and_reuse);
     RUN_TEST(test_realloc_expansion_strict);
     RUN_TEST(test_error_handling);
+    RUN_TEST(test_invalid_pointer_free);
 
     
     // Part B
@@ -272,7 +1319,38 @@ int main() {
     RUN_TEST(test_coalescing_merge);
     RUN_TEST(test_release_to_os);
     RUN_TEST(test_realloc_split);
+    RUN_TEST(test_realloc_in_place);
+    RUN_TEST(test_calloc_zeroing);
+    RUN_TEST(test_region);
+    RUN_TEST(test_large_allocation);
+    RUN_TEST(test_huge_requests);
+    RUN_TEST(test_best_fit_size_classes);
+    RUN_TEST(test_compact_header);
+    RUN_TEST(test_slab_small_objects);
+    RUN_TEST(test_aligned_allocation);
+    RUN_TEST(test_deferred_coalescing);
+    RUN_TEST(test_trim);
+    RUN_TEST(test_malloc_stats);
     RUN_TEST(test_mt_contention);
+    RUN_TEST(test_mt_area_locks);
+    RUN_TEST(test_mt_thread_cache);
+    RUN_TEST(test_mt_home_area);
+    RUN_TEST(test_mt_large_allocation);
+    RUN_TEST(test_mt_configured_heap);
+    RUN_TEST(test_mt_failed_areas);
+    RUN_TEST(test_mt_concurrent_growth);
+    RUN_TEST(test_mt_per_cpu_areas);
+    RUN_TEST(test_mt_per_cpu_steal);
+    RUN_TEST(test_mt_huge_pages);
+    RUN_TEST(test_mt_remote_free);
+    RUN_TEST(test_mt_realloc_into_neighbours);
+    RUN_TEST(test_mt_batch);
+    RUN_TEST(test_mt_usable_size);
+    RUN_TEST(test_sized_free);
+    RUN_TEST(test_heap_profile);
+    RUN_TEST(test_heap_profile_aligned);
+    RUN_TEST(test_mt_fork);
+    RUN_TEST(test_preload_huge_requests);
     
     std::cout << "=== Advanced Tests Passed ===\n" << std::endl;
     
@@ -0,0 +1,106 @@
+// global operator new and delete on the MT heap, built into
+// libcustommalloc.so next to the malloc family. sized deletes hand the size
+// on to customMTFreeSized. this file is C++17 for the aligned overloads.
+#include "customAllocator.h"
+#include "malloc_preload.h"
+#include <new>
+
+// new never returns nullptr: it asks the new handler to make room until
+// there is none left to ask, then throws. no handler can make room for a
+// size that is too large.
+static void *allocate(size_t size, size_t alignment) {
+  if (tooLarge(size))
+    throw std::bad_alloc();
+  ensureHeap();
+  if (size == 0)
+    size = 1; // every new returns a unique pointer
+  for (;;) {
+    void *ptr = alignment <= CUSTOM_ALIGNMENT
+                    ? customMTMalloc(size)
+                    : customMTAlignedAlloc(alignment, size);
+    if (ptr != nullptr)
+      return ptr;
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr)
+      throw std::bad_alloc();
+    handler();
+  }
+}
+
+static void *allocateNoThrow(size_t size, size_t alignment) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+// new turned 0 into 1, which sizes the block the same way
+static void release(void *ptr, size_t size) noexcept {
+  if (ptr != nullptr)
+    customMTFreeSized(ptr, size == 0 ? 1 : size);
+}
+
+static void release(void *ptr) noexcept {
+  if (ptr != nullptr)
+    customMTFree(ptr);
+}
+
+void *operator new(size_t size) { return allocate(size, CUSTOM_ALIGNMENT); }
+void *operator new[](size_t size) { return allocate(size, CUSTOM_ALIGNMENT); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, CUSTOM_ALIGNMENT);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, CUSTOM_ALIGNMENT);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  return allocate(size, (size_t)alignment);
+}
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return allocate(size, (size_t)alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, (size_t)alignment);
+}
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocateNoThrow(size, (size_t)alignment);
+}
+
+void operator delete(void *ptr) noexcept { release(ptr); }
+void operator delete[](void *ptr) noexcept { release(ptr); }
+
+void operator delete(void *ptr, size_t size) noexcept { release(ptr, size); }
+void operator delete[](void *ptr, size_t size) noexcept { release(ptr, size); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept { release(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { release(ptr); }
+
+void operator delete(void *ptr, size_t size, std::align_val_t) noexcept {
+  release(ptr, size);
+}
+void operator delete[](void *ptr, size_t size, std::align_val_t) noexcept {
+  release(ptr, size);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  release(ptr);
+}
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  release(ptr);
+}